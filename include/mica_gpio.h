@@ -1,12 +1,30 @@
 /*
  * mcp2210.h
  *
+ * Several processes share one device if each sets the environment variable MICA_GPIO_BROKER=1. The first process
+ * owns the device, the others follow it. Only processes of the same user, or of members of the group mica-gpio if it
+ * exists, can share the device.
  */
 
 #ifndef MICA_GPIO_H
 #define MICA_GPIO_H
 
-#define MICA_GPIO_SIZE 8
+#include <stdint.h>
+
+/** Pins of each SPI switch */
+#define MICA_GPIO_CHANNELS 8
+
+/** Maximum number of pins, with up to eight switches on separate chip selects, see mica_gpio_get_count */
+#define MICA_GPIO_SIZE 64
+
+#define MICA_GPIO_HISTOGRAM_SIZE 32
+
+/** Callback ids not referring to a pin */
+#define MICA_GPIO_STARTED       0 // poll thread started
+#define MICA_GPIO_STOPPED      -1 // poll thread stopped
+#define MICA_GPIO_DISCONNECTED -2 // device lost, outputs are restored once it is back
+#define MICA_GPIO_CONNECTED    -3 // device reopened and state restored
+#define MICA_GPIO_GLITCH       -4 // edges counted on the interrupt pin GP6 have been missed by polling, only while all pins are polled inputs
 
 enum MICA_GPIO_DIRECTION {
 	INPUT, OUTPUT
@@ -16,9 +34,156 @@ enum MICA_GPIO_STATE {
 	LOW, HIGH
 };
 
+enum MICA_GPIO_EDGE {
+	EDGE_NONE, EDGE_RISING, EDGE_FALLING, EDGE_BOTH
+};
+
+/** Edge reported by mica_gpio_wait */
+struct mica_gpio_event {
+	/** Pin [1-mica_gpio_get_count()] */
+	int id;
+	/** State after the edge */
+	enum MICA_GPIO_STATE state;
+	/** Number of the poll cycle detecting the edge */
+	unsigned long long cycle;
+};
+
+/** Configuration of all pins, bit n - 1 refers to pin n, see mica_gpio_set_config */
+struct mica_gpio_config {
+	/** Pins configured as output, all other pins are inputs */
+	uint64_t outputs;
+	/** Inputs with enabled diagnosis current, reporting their state and edges */
+	uint64_t enabled;
+};
+
+/** Time a pin has been sampled, on CLOCK_MONOTONIC like System.nanoTime() of Java */
+struct mica_gpio_timestamp {
+	/** Best estimate of the sample time (ns) */
+	unsigned long long time;
+	/** The sample has been taken within time - uncertainty and time + uncertainty (ns) */
+	unsigned long long uncertainty;
+};
+
 typedef void (*mica_gpio_callback)(int id, enum MICA_GPIO_STATE state, void *data);
 
+/** Callback receiving the sample time of edges, NULL for ids not referring to a pin */
+typedef void (*mica_gpio_timed_callback)(int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp, void *data);
+
+/** Real-time execution settings of the poll thread */
+struct mica_gpio_realtime {
+	/** Scheduling policy [SCHED_OTHER = 0, SCHED_FIFO = 1, SCHED_RR = 2] */
+	int policy;
+	/** Scheduling priority [1-99 for SCHED_FIFO and SCHED_RR] */
+	int priority;
+	/** CPU the poll thread is pinned to, -1 for no affinity */
+	int cpu;
+	/** Lock all current and future pages into memory */
+	int lock_memory;
+};
+
+/** HID commands of the MCP 2210, accounted in mica_gpio_statistics.commands */
+enum MICA_GPIO_COMMAND {
+	COMMAND_CHIP_SETTINGS_GET,
+	COMMAND_CHIP_SETTINGS_SET,
+	COMMAND_TRANSFER_SETTINGS_GET,
+	COMMAND_TRANSFER_SETTINGS_SET,
+	COMMAND_SPI_SETTINGS_SET,
+	COMMAND_SPI_TRANSFER,
+	COMMAND_CURRENT_CHIP_SETTINGS_SET,
+	COMMAND_INTERRUPT_EVENTS_GET
+};
+
+#define MICA_GPIO_COMMANDS 8
+
+/** Statistics of a HID command */
+struct mica_gpio_command_statistics {
+	/** Number of commands sent, not counting retries */
+	unsigned long long count;
+	/** Number of commands repeated after a busy response */
+	unsigned long long retries;
+	/** Number of commands without response within the timeout */
+	unsigned long long timeouts;
+	/** Number of failed commands */
+	unsigned long long failures;
+	/** Sum of the time from sending a command until its response (ns) */
+	unsigned long long latency_sum;
+	/** Maximum time from sending a command until its response (ns) */
+	unsigned long long latency_max;
+};
+
+/** Poll loop statistics */
+struct mica_gpio_statistics {
+	/** Number of poll cycles */
+	unsigned long long cycles;
+	/** Minimum loop period (ns) */
+	unsigned long long period_min;
+	/** Maximum loop period (ns) */
+	unsigned long long period_max;
+	/** Sum of all loop periods (ns) */
+	unsigned long long period_sum;
+	/** Loop period distribution in steps of 1 ms, the last entry counts all longer periods */
+	unsigned long long period_histogram[MICA_GPIO_HISTOGRAM_SIZE];
+	/** Number of failed SPI transfers */
+	unsigned long long errors;
+	/** Number of SPI frames transferred by the poll loop */
+	unsigned long long transfers;
+	/** Time spent transferring SPI frames by the poll loop (ns) */
+	unsigned long long transfer_time;
+	/** Number of times the device has been reopened after it was lost */
+	unsigned long long reconnects;
+	/** Time from losing the device until outputs have been restored, last occurrence (ns) */
+	unsigned long long recover_time;
+	/** Time from losing the device until outputs have been restored, maximum (ns) */
+	unsigned long long recover_time_max;
+	/** Number of frames answered with transmission error (TER) by the switches */
+	unsigned long long transmission_errors;
+	/** Number of times the bit rate has been lowered after transmission errors */
+	unsigned long long rate_drops;
+	/** SPI bit rate in use (bit/s) */
+	unsigned long long bit_rate;
+	/** Number of falling edges counted on the interrupt pin GP6, if not needed as chip select */
+	unsigned long long interrupt_events;
+	/**
+	 * Number of edges counted on the interrupt pin but not seen by polling, relative to interrupt_events the missed-edge
+	 * rate. Only determined while all pins are polled inputs, as the pin counts edges of all channels.
+	 */
+	unsigned long long missed_edges;
+	/** Number of times the switches have been put in stand-by */
+	unsigned long long standbys;
+	/** Number of times the switches have been woken up from stand-by */
+	unsigned long long wakeups;
+	/** Time from a wake-up request until the registers have been restored, last occurrence (ns) */
+	unsigned long long wake_time;
+	/** Time from a wake-up request until the registers have been restored, maximum (ns) */
+	unsigned long long wake_time_max;
+	/** Number of events dropped by full listener queues */
+	unsigned long long dropped_events;
+	/** Statistics per HID command, indexed by enum MICA_GPIO_COMMAND */
+	struct mica_gpio_command_statistics commands[MICA_GPIO_COMMANDS];
+};
+
 void *mica_gpio_set_callback(mica_gpio_callback callback, void *data);
+void *mica_gpio_set_timed_callback(mica_gpio_timed_callback callback, void *data);
+
+int mica_gpio_add_listener(mica_gpio_callback callback, void *data, unsigned int queue);
+int mica_gpio_add_timed_listener(mica_gpio_timed_callback callback, void *data, unsigned int queue);
+int mica_gpio_remove_listener(int handle);
+
+int mica_gpio_set_realtime(const struct mica_gpio_realtime *realtime);
+void mica_gpio_get_realtime(struct mica_gpio_realtime *realtime);
+
+void mica_gpio_get_statistics(struct mica_gpio_statistics *statistics);
+void mica_gpio_reset_statistics(void);
+
+int mica_gpio_set_period(long long period);
+long long mica_gpio_get_period(void);
+
+int mica_gpio_set_standby(long long idle);
+long long mica_gpio_get_standby(void);
+
+int mica_gpio_calibrate(void);
+
+int mica_gpio_get_count(void);
 
 enum MICA_GPIO_DIRECTION mica_gpio_get_direction(unsigned char id);
 void mica_gpio_set_direction(unsigned char id, enum MICA_GPIO_DIRECTION direction);
@@ -26,7 +191,18 @@ void mica_gpio_set_direction(unsigned char id, enum MICA_GPIO_DIRECTION directio
 unsigned char mica_gpio_get_enable(unsigned char id);
 void mica_gpio_set_enable(unsigned char id, unsigned char enable);
 
+void mica_gpio_get_config(struct mica_gpio_config *config);
+int mica_gpio_set_config(const struct mica_gpio_config *config);
+
+enum MICA_GPIO_EDGE mica_gpio_get_edge(unsigned char id);
+void mica_gpio_set_edge(unsigned char id, enum MICA_GPIO_EDGE edge);
+
 enum MICA_GPIO_STATE mica_gpio_get_state(unsigned char id);
 void mica_gpio_set_state(unsigned char id, enum MICA_GPIO_STATE state);
 
+int mica_gpio_wait(uint64_t mask, enum MICA_GPIO_EDGE edge, long long timeout, struct mica_gpio_event *event);
+
+uint64_t mica_gpio_get_states(void);
+void mica_gpio_set_states(uint64_t mask, uint64_t states);
+
 #endif /* MICA_GPIO_H */
@@ -0,0 +1,82 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mica_gpio.h"
+
+/** Names of the HID commands, indexed by enum MICA_GPIO_COMMAND */
+const char *commands[MICA_GPIO_COMMANDS] = { "Get Chip Settings", "Set Chip Settings", "Get Transfer Settings", "Set Transfer Settings",
+		"Set SPI Transfer Settings", "Transfer SPI Data", "Set Current Chip Settings", "Get Interrupt Events" };
+
+void cb(int id, enum MICA_GPIO_STATE state, void *data) {
+}
+
+/**
+ * Polls all inputs for the given time and writes the loop period distribution to stdout
+ */
+void measure(const char *name, unsigned int seconds) {
+	struct mica_gpio_statistics statistics;
+
+	mica_gpio_reset_statistics();
+	mica_gpio_set_callback(cb, NULL);
+	sleep(seconds);
+	mica_gpio_set_callback(NULL, NULL);
+	mica_gpio_get_statistics(&statistics);
+
+	printf("%s\n", name);
+	printf(" Cycles: %llu\n", statistics.cycles);
+	printf(" Errors: %llu\n", statistics.errors);
+	if (statistics.interrupt_events > 0)
+		printf(" Missed edges: %llu of %llu (%.2f%%) at period %lld us\n", statistics.missed_edges, statistics.interrupt_events,
+				100.0 * statistics.missed_edges / statistics.interrupt_events, mica_gpio_get_period() / 1000);
+	if (statistics.wakeups > 0)
+		printf(" Stand-by: %llu, wake-ups: %llu, wake time last/max (us): %llu/%llu\n", statistics.standbys, statistics.wakeups,
+				statistics.wake_time / 1000, statistics.wake_time_max / 1000);
+	printf(" SPI bit rate: %llu bit/s, transmission errors: %llu, rate drops: %llu\n", statistics.bit_rate, statistics.transmission_errors,
+			statistics.rate_drops);
+	if (statistics.cycles > 0) {
+		printf(" Period min/avg/max (us): %llu/%llu/%llu\n", statistics.period_min / 1000, statistics.period_sum / statistics.cycles / 1000,
+				statistics.period_max / 1000);
+		for (int i = 0; i < MICA_GPIO_HISTOGRAM_SIZE; i++)
+			if (statistics.period_histogram[i] > 0)
+				printf(" %s%2d ms: %llu\n", i == MICA_GPIO_HISTOGRAM_SIZE - 1 ? ">=" : "  ", i, statistics.period_histogram[i]);
+	}
+	if (statistics.transfer_time > 0)
+		printf(" SPI frames: %llu (%llu frames/s)\n", statistics.transfers, statistics.transfers * 1000000000ULL / statistics.transfer_time);
+	for (int i = 0; i < MICA_GPIO_COMMANDS; i++) {
+		struct mica_gpio_command_statistics *command = &statistics.commands[i];
+		if (command->count > 0)
+			printf(" %s latency avg/max (us): %llu/%llu, retries: %llu, timeouts: %llu\n", commands[i], command->latency_sum / command->count / 1000,
+					command->latency_max / 1000, command->retries, command->timeouts);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/**
+ * Usage: benchmark [seconds] [priority] [cpu]
+ * Build the library with BACKEND=hidapi and BACKEND=libusb to compare the SPI frame throughput of both transports.
+ */
+int main(int argc, char* argv[]) {
+	unsigned int seconds = argc > 1 ? atoi(argv[1]) : 10;
+	struct mica_gpio_realtime realtime = { //
+			.policy = SCHED_FIFO, //
+					.priority = argc > 2 ? atoi(argv[2]) : 80, //
+					.cpu = argc > 3 ? atoi(argv[3]) : -1, //
+					.lock_memory = 1 };
+
+	for (int i = 1; i <= mica_gpio_get_count(); i++) {
+		mica_gpio_set_direction(i, INPUT);
+		mica_gpio_set_enable(i, 1);
+	}
+
+	measure("Default mode", seconds);
+
+	if (mica_gpio_set_realtime(&realtime) < 0) {
+		printf("Failed to apply real-time settings\n");
+		return 1;
+	}
+	measure("Real-time mode", seconds);
+	return 0;
+}
@@ -0,0 +1,28 @@
+from select import select
+
+import mica_gpio
+
+for id in range(1, mica_gpio.get_count() + 1):
+  mica_gpio.set_direction(id, mica_gpio.INPUT)
+  mica_gpio.set_enable(id, True)
+
+with mica_gpio.Events() as events:
+  # wait for edges with select(), then take all queued edges at once
+  for i in range(10):
+    readable, _, _ = select([events], [], [], 5)
+    if readable:
+      for time, id, state in events.read(timeout=0):
+        if id == mica_gpio.DISCONNECTED:
+          print("%d ns: Device lost" % time)
+        elif id == mica_gpio.CONNECTED:
+          print("%d ns: Device back" % time)
+        elif id == mica_gpio.GLITCH:
+          print("%d ns: Edges missed by polling" % time)
+        elif id > 0:
+          print("%d ns: Input: %d state: %d" % (time, id, state))
+  print("States: %s" % bin(mica_gpio.get_states()))
+
+  # or iterate over batches, each call waits with the GIL released
+  for batch in events:
+    print("Batch of %d edges, dropped: %d" % (len(batch), events.dropped))
+    break
@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mica_gpio.h"
+
+unsigned long long edges = 0, glitches = 0;
+
+void cb(int id, enum MICA_GPIO_STATE state, void *data) {
+	if (id > 0)
+		__atomic_add_fetch(&edges, 1, __ATOMIC_RELAXED);
+	else if (id == MICA_GPIO_GLITCH)
+		__atomic_add_fetch(&glitches, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Usage: glitch [seconds] [enabled]
+ * Checks that edges of pins not polled are not reported as missed. All pins are inputs, those selected by the hex
+ * mask enabled (default upper half). Build the library with BACKEND=sim, its inputs toggle on their own and each
+ * falling edge of any pin is counted on the interrupt pin. Exits with 1 if GLITCH was reported while not all pins
+ * are enabled.
+ */
+int main(int argc, char* argv[]) {
+	unsigned int seconds = argc > 1 ? atoi(argv[1]) : 10;
+	int count = mica_gpio_get_count();
+	uint64_t all = count < 64 ? (1ULL << count) - 1 : -1ULL;
+	uint64_t enabled = (argc > 2 ? strtoull(argv[2], NULL, 16) : all & ~((1ULL << count / 2) - 1)) & all;
+
+	for (int i = 1; i <= count; i++) {
+		mica_gpio_set_direction(i, INPUT);
+		mica_gpio_set_enable(i, (enabled >> (i - 1)) & 1);
+	}
+	mica_gpio_set_callback(cb, NULL);
+	mica_gpio_reset_statistics();
+	sleep(seconds);
+	mica_gpio_set_callback(NULL, NULL);
+
+	struct mica_gpio_statistics statistics;
+	mica_gpio_get_statistics(&statistics);
+	printf("Enabled: %llx, edges: %llu, glitches: %llu, interrupt events: %llu, missed edges: %llu\n", (unsigned long long) enabled, edges,
+			glitches, statistics.interrupt_events, statistics.missed_edges);
+	if (enabled != all && glitches > 0) {
+		printf("FAILED: edges of pins not polled reported as missed\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# latency.sh
+#
+# Latency of each stage of the edge to Java path, recorded with perf from the static tracepoints of libmica-gpio
+# built with PROBES=1. Use this where bpftrace is not available (e.g. armhf), otherwise see latency.bt.
+#
+# Usage: latency.sh [seconds] [library]
+#
+
+DURATION=${1:-10}
+LIBRARY=${2:-/usr/lib/libmica-gpio.so}
+DATA=$(mktemp /tmp/mica_gpio.XXXXXX)
+
+set -e
+perf buildid-cache --add "$LIBRARY"
+for probe in hid_write hid_write_done hid_read hid_read_done register_send register_done poll poll_done dispatch \
+		dispatch_done jni_call jni_call_done; do
+	perf probe -q -d "sdt_mica_gpio:$probe" 2>/dev/null || true
+	perf probe -q "sdt_mica_gpio:$probe"
+done
+perf record -q -o "$DATA" -e 'sdt_mica_gpio:*' -a -- sleep "$DURATION"
+
+# pair each probe with its _done probe on the same thread, frames are pipelined and answered in order
+perf script -i "$DATA" -F tid,time,event | awk '
+function record(stage, since) {
+	latency = ($2 - since) * 1000000;
+	count[stage]++;
+	sum[stage] += latency;
+	if (latency > max[stage])
+		max[stage] = latency;
+}
+{
+	sub(":$", "", $2);
+	event = $3;
+	sub("^sdt_mica_gpio:", "", event);
+	sub(":$", "", event);
+	tid = $1;
+	if (event == "register_send") {
+		frames[tid, sent[tid]++] = $2;
+	} else if (event == "register_done") {
+		if (done[tid] < sent[tid])
+			record("register", frames[tid, done[tid]++]);
+	} else if (event ~ /_done$/) {
+		stage = substr(event, 1, length(event) - 5);
+		if ((tid, stage) in start) {
+			record(stage, start[tid, stage]);
+			delete start[tid, stage];
+		}
+		if (stage == "jni_call" && (tid, "poll") in begin)
+			record("edge_to_java", begin[tid, "poll"]);
+	} else {
+		start[tid, event] = $2;
+		if (event == "poll")
+			begin[tid, event] = $2;
+	}
+}
+END {
+	printf("%-14s %10s %10s %10s (us)\n", "Stage", "count", "avg", "max");
+	n = split("hid_write hid_read register poll dispatch jni_call edge_to_java", stages, " ");
+	for (i = 1; i <= n; i++)
+		if (count[stages[i]] > 0)
+			printf("%-14s %10d %10.1f %10.1f\n", stages[i], count[stages[i]], sum[stages[i]] / count[stages[i]], max[stages[i]]);
+}'
+rm -f "$DATA"
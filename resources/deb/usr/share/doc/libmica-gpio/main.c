@@ -14,6 +14,8 @@ void cb(int id, enum MICA_GPIO_STATE state, void *data) {
 int main(int argc, char* argv[]) {
 	char *data = "user data";
 	mica_gpio_set_callback(cb, data);
+	// further consumers are added as listeners, this one called by its own thread
+	int listener = mica_gpio_add_listener(cb, "listener data", 16);
 
 	int direction = mica_gpio_get_direction(1);
 	printf("Direction %d\n", direction);
@@ -29,5 +31,6 @@ int main(int argc, char* argv[]) {
 	sleep(1);
 	mica_gpio_set_state(1, LOW);
 
+	mica_gpio_remove_listener(listener);
 	mica_gpio_set_callback(NULL, NULL);
 }
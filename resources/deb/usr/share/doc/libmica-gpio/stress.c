@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mica_gpio.h"
+
+#define BUCKETS  32 // latency histogram, bucket n counts latencies below 2^n us
+#define DEADLOCK 10 // seconds without progress of a thread reported as deadlock
+#define STARVED  10 // default minimum poll rate, in percent of the rate set by the poll period
+
+/** Operations exercised */
+enum operation {
+	SET_STATE, GET_STATE, SET_ENABLE, SET_CONFIG, SET_EDGE, WAIT, SET_CALLBACK, LISTENER, OPERATIONS
+};
+
+const char *names[OPERATIONS] = { "set_state", "get_state", "set_enable", "set_config", "set_edge", "wait", "set_callback", "add/remove_listener" };
+
+/** Statistics of a worker thread */
+struct worker {
+	enum operation operation;
+	pthread_t thread;
+	unsigned int seed;
+	/** Number of completed operations, watched for progress */
+	unsigned long long count;
+	unsigned long long max;
+	unsigned long long histogram[BUCKETS];
+};
+
+int outputs, inputs, running = 1;
+unsigned long long events = 0;
+
+void cb(int id, enum MICA_GPIO_STATE state, void *data) {
+	if (id > 0)
+		__atomic_add_fetch(&events, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long long now() {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec * 1000000000ULL + time.tv_nsec;
+}
+
+/**
+ * Executes one operation of the worker on a random pin
+ */
+void execute(struct worker *worker) {
+	int output = 1 + rand_r(&worker->seed) % outputs, input = outputs + 1 + rand_r(&worker->seed) % inputs;
+	// all input pins
+	uint64_t mask = (outputs + inputs < 64 ? 1ULL << (outputs + inputs) : 0) - (1ULL << outputs);
+	switch (worker->operation) {
+	case SET_STATE:
+		mica_gpio_set_state(output, rand_r(&worker->seed) & 1);
+		break;
+	case GET_STATE:
+		mica_gpio_get_state(input);
+		break;
+	case SET_ENABLE:
+		mica_gpio_set_enable(input, rand_r(&worker->seed) & 1);
+		break;
+	case SET_CONFIG: {
+		// keep the directions, enable a random set of inputs
+		struct mica_gpio_config config = { .outputs = (1ULL << outputs) - 1, .enabled = ((uint64_t) rand_r(&worker->seed) << outputs) & mask };
+		mica_gpio_set_config(&config);
+		break;
+	}
+	case SET_EDGE:
+		mica_gpio_set_edge(input, rand_r(&worker->seed) % 4);
+		break;
+	case WAIT: {
+		// edges of a random set of inputs, while the subscribed edges change
+		struct mica_gpio_event event;
+		if (mica_gpio_wait(((uint64_t) rand_r(&worker->seed) << outputs) & mask, 1 + rand_r(&worker->seed) % 3, 10000000, &event) < 0)
+			usleep(1000);
+		break;
+	}
+	case SET_CALLBACK:
+		mica_gpio_set_callback(rand_r(&worker->seed) & 1 ? cb : NULL, NULL);
+		usleep(10000);
+		break;
+	case LISTENER: {
+		int listener = mica_gpio_add_listener(cb, NULL, rand_r(&worker->seed) & 1 ? 16 : 0);
+		usleep(1000);
+		mica_gpio_remove_listener(listener);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+void *run(void *arg) {
+	struct worker *worker = arg;
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		unsigned long long start = now();
+		execute(worker);
+		unsigned long long latency = (now() - start) / 1000;
+		int bucket = 0;
+		while (bucket < BUCKETS - 1 && latency >= 1ULL << bucket)
+			bucket++;
+		worker->histogram[bucket]++;
+		if (latency > worker->max)
+			worker->max = latency;
+		__atomic_add_fetch(&worker->count, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * @returns upper bound of the latency percentile (us)
+ */
+unsigned long long percentile(const unsigned long long *histogram, unsigned long long count, double p) {
+	unsigned long long sum = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		sum += histogram[i];
+		if (sum >= count * p)
+			return 1ULL << i;
+	}
+	return -1ULL;
+}
+
+/**
+ * Usage: stress [seconds] [threads per operation] [minimum poll rate]
+ * Build the library with BACKEND=sim to run against a simulated device, faults are injected as set by the
+ * MICA_GPIO_SIM_* environment variables, e.g. MICA_GPIO_SIM_DROP=1 MICA_GPIO_SIM_BUSY=20 MICA_GPIO_SIM_SPIKE=5
+ * MICA_GPIO_SIM_DISCONNECT=1. Build with SANITIZE=thread to detect data races.
+ * A listener keeps the poll thread running while the callback is removed. The poll rate (cycles/s) defaults to
+ * STARVED percent of the rate set by the poll period, lower it for sanitizer builds or machines with few cores.
+ * Exits with 2 if a thread made no progress for DEADLOCK seconds, and with 3 if the poll thread was starved.
+ */
+int main(int argc, char* argv[]) {
+	unsigned int seconds = argc > 1 ? atoi(argv[1]) : 60;
+	int threads = argc > 2 ? atoi(argv[2]) : 4;
+	double minimum = argc > 3 ? atof(argv[3]) : 1e9 / mica_gpio_get_period() * STARVED / 100;
+	int count = mica_gpio_get_count();
+	outputs = count / 2;
+	inputs = count - outputs;
+	for (int i = 1; i <= count; i++)
+		mica_gpio_set_direction(i, i <= outputs ? OUTPUT : INPUT);
+
+	int workers = threads * (OPERATIONS - 2) + 2;
+	struct worker *worker = calloc(workers, sizeof(struct worker));
+	for (int i = 0; i < workers; i++) {
+		// threads of each pin operation, and one thread each changing the callback and listeners
+		worker[i].operation = i < workers - 2 ? i % (OPERATIONS - 2) : OPERATIONS - workers + i;
+		worker[i].seed = i + 1;
+		pthread_create(&worker[i].thread, NULL, run, &worker[i]);
+	}
+
+	int listener = mica_gpio_add_listener(cb, NULL, 0);
+	mica_gpio_reset_statistics();
+	unsigned long long start = now(), progress[workers];
+	int stalled[workers];
+	memset(stalled, 0, sizeof(stalled));
+	for (int i = 0; i < workers; i++)
+		progress[i] = 0;
+	for (unsigned int s = 0; s < seconds; s++) {
+		sleep(1);
+		for (int i = 0; i < workers; i++) {
+			unsigned long long done = __atomic_load_n(&worker[i].count, __ATOMIC_ACQUIRE);
+			stalled[i] = done == progress[i] ? stalled[i] + 1 : 0;
+			progress[i] = done;
+			if (stalled[i] == DEADLOCK) {
+				printf("DEADLOCK: thread %d stuck in %s for %d s\n", i, names[worker[i].operation], DEADLOCK);
+				fflush(stdout);
+				_exit(2);
+			}
+		}
+	}
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	for (int i = 0; i < workers; i++)
+		pthread_join(worker[i].thread, NULL);
+	double elapsed = (now() - start) / 1e9;
+
+	printf("Operation              ops/s       p50      p99    p99.9      max (us)\n");
+	for (int o = 0; o < OPERATIONS; o++) {
+		unsigned long long histogram[BUCKETS] = { }, total = 0, max = 0;
+		for (int i = 0; i < workers; i++) {
+			if (worker[i].operation != o)
+				continue;
+			for (int b = 0; b < BUCKETS; b++)
+				histogram[b] += worker[i].histogram[b];
+			total += worker[i].count;
+			if (worker[i].max > max)
+				max = worker[i].max;
+		}
+		if (total > 0)
+			printf("%-20s %8.0f <%7llu <%7llu <%7llu %8llu\n", names[o], total / elapsed, percentile(histogram, total, 0.5),
+					percentile(histogram, total, 0.99), percentile(histogram, total, 0.999), max);
+	}
+
+	struct mica_gpio_statistics statistics;
+	mica_gpio_get_statistics(&statistics);
+	mica_gpio_remove_listener(listener);
+	mica_gpio_set_callback(NULL, NULL);
+	double rate = statistics.cycles / elapsed;
+	printf("\nEvents: %llu, cycles: %llu, errors: %llu, reconnects: %llu\n", events, statistics.cycles, statistics.errors, statistics.reconnects);
+	printf("Poll rate: %.0f cycles/s, minimum: %.0f cycles/s\n", rate, minimum);
+	for (int i = 0; i < MICA_GPIO_COMMANDS; i++) {
+		struct mica_gpio_command_statistics *command = &statistics.commands[i];
+		if (command->count > 0)
+			printf(" Command %d: %llu, retries: %llu, timeouts: %llu, failures: %llu\n", i, command->count, command->retries, command->timeouts,
+					command->failures);
+	}
+	free(worker);
+	if (rate < minimum) {
+		printf("STARVED: poll thread below the minimum rate\n");
+		return 3;
+	}
+	return 0;
+}
@@ -2,21 +2,36 @@
 
 #include <jni.h>
 #include <linux/jni_md.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "../include/mica_gpio.h"
+#include "mica_gpio_probes.h"
 
 struct runtime {
 	JavaVM *jvm;
 	JNIEnv *env;
+	/** Listener set by setListener, NULL if only group listeners are set */
 	jobject listener;
 	jclass state;
 	jclass state_event;
 	jclass state_listener;
+	jmethodID init;
+	/** StateEvent(short, State, long, long) taking sample time and uncertainty (ns), NULL if not available */
+	jmethodID init_timed;
+	jmethodID state_changed;
 };
 typedef struct runtime runtime;
 
+/** Listeners of pin groups, replacing the listener of the runtime for their pins */
+static jobject listeners[MICA_GPIO_SIZE] = { };
+static pthread_mutex_t lock_listeners = PTHREAD_MUTEX_INITIALIZER;
+
+/** Runtime of the callback, NULL while no listener is set. Replaced holding lock_runtime. */
+static runtime *active = NULL;
+static pthread_mutex_t lock_runtime = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Gets Lhavis/device/io/State; object from enumeration
  * @returns Java Lhavis/device/io/State; object
@@ -151,63 +166,193 @@ JNIEXPORT void JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_set
 	mica_gpio_set_enable(id, enable);
 }
 
+/*
+ * Class:     havis_device_io_common_ext_NativeHardwareManager
+ * Method:    getConfig
+ * Signature: ()[J
+ *
+ * Gets direction and enable of all pins as { outputs, enabled }, bit n - 1 of each refers to pin n.
+ */
+JNIEXPORT jlongArray JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_getConfig(JNIEnv *env, jobject this) {
+	struct mica_gpio_config config;
+	mica_gpio_get_config(&config);
+	jlong values[2] = { config.outputs, config.enabled };
+	jlongArray result = (*env)->NewLongArray(env, 2);
+	if (result)
+		(*env)->SetLongArrayRegion(env, result, 0, 2, values);
+	return result;
+}
+
+/*
+ * Class:     havis_device_io_common_ext_NativeHardwareManager
+ * Method:    setConfig
+ * Signature: (JJ)Z
+ *
+ * Sets direction and enable of all pins at once, bit n - 1 of outputs and enabled refers to pin n. The whole
+ * configuration is applied with the next poll cycle. Returns false if it is invalid, e.g. enables outputs.
+ */
+JNIEXPORT jboolean JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_setConfig(JNIEnv *env, jobject this, jlong outputs, jlong enabled) {
+	struct mica_gpio_config config = { .outputs = outputs, .enabled = enabled };
+	return mica_gpio_set_config(&config) == 0;
+}
+
 /*
  * Class:     havis_device_io_common_ext_NativeHardwareManager
  * Method:    getCount
  * Signature: ()S
  */
 JNIEXPORT jshort JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_getCount(JNIEnv *env, jobject this) {
-	return MICA_GPIO_SIZE;
+	return mica_gpio_get_count();
 }
 
 /**
- * Runs listener thread. Calls listener if state changed
+ * Runs listener thread. Calls listener if state changed, with the sample time of the edge on the clock of
+ * System.nanoTime() if StateEvent takes it
  */
-void call(int id, enum MICA_GPIO_STATE state, void *data) {
+void call(int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp, void *data) {
 	struct runtime *rt = data;
 	JNIEnv *env;
+	PROBE2(jni_call, id, state);
 	switch (id) {
-	case 0:
+	case MICA_GPIO_STARTED:
 		(*rt->jvm)->AttachCurrentThread(rt->jvm, (void**) &(rt->env), NULL);
 		break;
-	case -1:
+	case MICA_GPIO_STOPPED:
 		(*rt->jvm)->DetachCurrentThread(rt->jvm);
 		break;
+	case MICA_GPIO_DISCONNECTED:
+	case MICA_GPIO_CONNECTED:
+	case MICA_GPIO_GLITCH:
+		// StateListener has no notion of the device connection or missed edges
+		break;
 	default:
 		env = rt->env;
+		// take listener of the pin group, a local reference survives replacing the group listener
+		pthread_mutex_lock(&lock_listeners);
+		jobject listener = listeners[id - 1] ? listeners[id - 1] : rt->listener;
+		if (listener)
+			listener = (*env)->NewLocalRef(env, listener);
+		pthread_mutex_unlock(&lock_listeners);
+		// pin without listener, only group listeners are set
+		if (listener == NULL)
+			break;
+
 		// create state event
-		jmethodID init = (*env)->GetMethodID(env, rt->state_event, "<init>", "(SLhavis/device/io/State;)V");
-		jobject event = (*env)->NewObject(env, rt->state_event, init, id, get_state(env, rt->state, state));
+		jobject event;
+		if (rt->init_timed && timestamp)
+			event = (*env)->NewObject(env, rt->state_event, rt->init_timed, id, get_state(env, rt->state, state), (jlong) timestamp->time,
+					(jlong) timestamp->uncertainty);
+		else
+			event = (*env)->NewObject(env, rt->state_event, rt->init, id, get_state(env, rt->state, state));
 
 		// call stateChanged
-		jmethodID state_changed = (*env)->GetMethodID(env, rt->state_listener, "stateChanged", "(Lhavis/device/io/StateEvent;)V");
-		(*env)->CallVoidMethod(env, rt->listener, state_changed, event);
+		(*env)->CallVoidMethod(env, listener, rt->state_changed, event);
+		(*env)->DeleteLocalRef(env, event);
+		(*env)->DeleteLocalRef(env, listener);
 		break;
 	}
+	PROBE1(jni_call_done, id);
+}
+
+/**
+ * Creates runtime of the callback
+ * @param listener listener of all pins without group listener, NULL if only group listeners are set
+ */
+runtime *create_runtime(JNIEnv *env, jobject listener) {
+	runtime *rt = malloc(sizeof(runtime));
+	(*env)->GetJavaVM(env, &(rt->jvm));
+	rt->listener = listener ? (*env)->NewGlobalRef(env, listener) : NULL;
+	rt->state = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/State"));
+	rt->state_event = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/StateEvent"));
+	rt->state_listener = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/StateListener"));
+	rt->init = (*env)->GetMethodID(env, rt->state_event, "<init>", "(SLhavis/device/io/State;)V");
+	rt->init_timed = (*env)->GetMethodID(env, rt->state_event, "<init>", "(SLhavis/device/io/State;JJ)V");
+	// StateEvent without sample time, the failed lookup has thrown NoSuchMethodError
+	if (rt->init_timed == NULL)
+		(*env)->ExceptionClear(env);
+	rt->state_changed = (*env)->GetMethodID(env, rt->state_listener, "stateChanged", "(Lhavis/device/io/StateEvent;)V");
+	return rt;
+}
+
+/**
+ * Deletes runtime replaced as callback
+ */
+void delete_runtime(JNIEnv *env, runtime *rt) {
+	if (rt) {
+		(*env)->DeleteGlobalRef(env, rt->state_listener);
+		(*env)->DeleteGlobalRef(env, rt->state_event);
+		(*env)->DeleteGlobalRef(env, rt->state);
+		if (rt->listener)
+			(*env)->DeleteGlobalRef(env, rt->listener);
+		free(rt);
+	}
+}
+
+/**
+ * Replaces the runtime of the callback, stopping the callback if rt is NULL. lock_runtime must be held.
+ */
+void replace_runtime(JNIEnv *env, runtime *rt) {
+	active = rt;
+	delete_runtime(env, mica_gpio_set_timed_callback(rt ? call : NULL, rt));
 }
 
 /*
  * Class:     havis_device_io_common_ext_NativeHardwareManager
  * Method:    setListener
  * Signature: (Lhavis/device/io/StateListener;)V
+ *
+ * Sets listener of all pins without group listener. A null listener stops the callback and removes all group
+ * listeners as well.
  */
 JNIEXPORT void JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_setListener(JNIEnv *env, jobject this, jobject listener) {
-	runtime *rt = NULL;
-	if (listener) {
-		rt = malloc(sizeof(runtime));
-		(*env)->GetJavaVM(env, &(rt->jvm));
-		rt->listener = (*env)->NewGlobalRef(env, listener);
-		rt->state = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/State"));
-		rt->state_event = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/StateEvent"));
-		rt->state_listener = (*env)->NewGlobalRef(env, (*env)->FindClass(env, "havis/device/io/StateListener"));
+	pthread_mutex_lock(&lock_runtime);
+	replace_runtime(env, listener ? create_runtime(env, listener) : NULL);
+	if (listener == NULL) {
+		// the callback has stopped, release the group listeners
+		for (int i = 0; i < MICA_GPIO_SIZE; i++) {
+			pthread_mutex_lock(&lock_listeners);
+			jobject old = listeners[i];
+			listeners[i] = NULL;
+			pthread_mutex_unlock(&lock_listeners);
+			if (old) {
+				(*env)->DeleteGlobalRef(env, old);
+				mica_gpio_set_edge(i + 1, EDGE_BOTH);
+			}
+		}
 	}
-	rt = mica_gpio_set_callback(listener ? call : NULL, rt);
-	if (rt) {
-		(*env)->GetJavaVM(env, &(rt->jvm));
-		(*env)->DeleteGlobalRef(env, rt->state_listener);
-		(*env)->DeleteGlobalRef(env, rt->state_event);
-		(*env)->DeleteGlobalRef(env, rt->state);
-		(*env)->DeleteGlobalRef(env, rt->listener);
-		free(rt);
+	pthread_mutex_unlock(&lock_runtime);
+}
+
+/*
+ * Class:     havis_device_io_common_ext_NativeHardwareManager
+ * Method:    setGroupListener
+ * Signature: (JILhavis/device/io/StateListener;)V
+ *
+ * Sets listener for a group of pins, bit n - 1 of mask selects pin n. Only the given edges [1=rising, 2=falling,
+ * 3=both] of these pins are reported to the listener, other edges are dropped before any event is created.
+ * A null listener returns the pins to the listener set by setListener, reporting both edges. The callback is started
+ * by the first group listener if no listener is set, and stopped once neither is left.
+ */
+JNIEXPORT void JNICALL Java_havis_device_io_common_ext_NativeHardwareManager_setGroupListener(JNIEnv *env, jobject this, jlong mask, jint edges,
+		jobject listener) {
+	pthread_mutex_lock(&lock_runtime);
+	int groups = 0;
+	for (int i = 0; i < mica_gpio_get_count(); i++) {
+		if ((mask >> i) & 1) {
+			jobject old;
+			pthread_mutex_lock(&lock_listeners);
+			old = listeners[i];
+			listeners[i] = listener ? (*env)->NewGlobalRef(env, listener) : NULL;
+			pthread_mutex_unlock(&lock_listeners);
+			if (old)
+				(*env)->DeleteGlobalRef(env, old);
+			mica_gpio_set_edge(i + 1, listener ? edges & EDGE_BOTH : EDGE_BOTH);
+		}
+		groups |= listeners[i] != NULL;
 	}
+	if (groups && active == NULL)
+		replace_runtime(env, create_runtime(env, NULL));
+	else if (!groups && active != NULL && active->listener == NULL)
+		replace_runtime(env, NULL);
+	pthread_mutex_unlock(&lock_runtime);
 }
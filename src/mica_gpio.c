@@ -3,17 +3,22 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "../include/mica_gpio.h"
+#include "mica_gpio_transport.h"
+#include "mica_gpio_broker.h"
+#include "mica_gpio_probes.h"
 
-#include <hidapi/hidapi.h>
+#include <errno.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
-#define __USE_POSIX199309
 #include <time.h>
 #include <pthread.h>
 
@@ -31,7 +36,35 @@
 // Start diagnosis -> detect failure -> clear by next frame
 //
 
-#define TIMEOUT 1000
+#define TIMEOUT 1000 // wait for a response report (ms)
+
+#define BUSY_RETRIES 5      // repeat a command rejected as busy
+#define BACKOFF      100000 // delay before the first repetition, doubled on each (ns)
+
+#define VENDOR_ID  0x2b9d
+#define PRODUCT_ID 0x8001
+
+#define RETRY 100 // interval to look for a lost device (ms)
+
+#define HISTORY 64 // poll cycles remembered for waiting threads
+
+#define SWITCHES    8     // SPI switches addressable by chip selects GP1-GP8
+#define CHIP_SELECT 0x001 // power-up active chip select value, used for a single switch not answering detection
+
+#define DELAYS     2   // delays tried by calibration for each bit rate (quanta of 100 µs)
+#define REPEAT     4   // repetitions of the test patterns for each setting during calibration
+#define TER_WINDOW 200 // poll cycles transmission errors are counted over
+#define TER_LIMIT  2   // transmission errors tolerated per window before the bit rate is lowered
+
+#define INTERRUPT 6 // GP6 counts edges of the interrupt line, unless it selects a switch
+
+#define PERIOD     5000000    // default poll period (ns)
+#define PERIOD_MIN 100000     // shortest poll period accepted (ns)
+#define PERIOD_MAX 1000000000 // longest poll period accepted (ns)
+#define STANDBY        100000000 // wait of the poll thread while the switches are in stand-by (ns)
+#define STANDBY_CHECKS 10        // waits in stand-by between reads of the interrupt counter
+
+#define PREFAULT   65536      // stack size touched by the poll thread before entering the loop (bytes)
 
 #define READ  0x00
 #define WRITE 0x80
@@ -41,6 +74,9 @@
 
 #define DCCR  4 // b100-b101
 
+#define TER   0x80 // Transmission Error of the previous frame, in every response
+#define OL    0x0a // Open Load bits of a diagnosis register read, cleared by the read
+
 #define CMD   0xe0
 #define WAKE  0x8  // Wake-Up
 #define STB   0x4  // Stand-By
@@ -93,48 +129,239 @@ struct pin {
 	enum MICA_GPIO_DIRECTION direction;
 	int enabled;
 };
-struct pin pins[MICA_GPIO_SIZE] = { };
+static struct pin pins[MICA_GPIO_SIZE] = { };
+
+/** Active chip select values of the detected switches, pin n belongs to switch (n - 1) / MICA_GPIO_CHANNELS */
+static unsigned short chip_select[SWITCHES] = { CHIP_SELECT };
+static int switches = 1;
+/** Number of pins of all detected switches */
+static int size = MICA_GPIO_CHANNELS;
+/** Active chip select value set in the MCP 2210, 0 if unknown */
+static unsigned short selected = 0;
+
+/** SPI bit rates tried by calibration, fastest first (bit/s) */
+static const unsigned int rates[] = { 12000000, 8000000, 6000000, 5000000, 4000000, 3000000, 2000000, 1000000, 500000 };
+#define RATES ((int) (sizeof(rates) / sizeof(rates[0])))
+
+/** Transmission errors within the current window, and poll cycles of the window */
+static unsigned int transmission_errors = 0;
+static unsigned int window = 0;
+
+/** Interrupt pin counts edges, and falling edges seen by polling before being counted */
+static int interrupts = 0;
+static unsigned int credit = 0;
+
+/** Poll period (ns) */
+static long long period = PERIOD;
+
+/** Quiet time before the switches are put in stand-by (ns), 0 to keep them awake */
+static long long idle = 0;
+/** Switches in stand-by, changed with lock_spi held. The poll thread waits on cond_standby meanwhile. */
+static int standby = 0;
+static pthread_cond_t cond_standby;
+/** Last time inputs were enabled or outputs HIGH, or the device was used */
+static struct timespec active;
+
+static uint64_t bank = 0;
+
+/** Pins with enabled callback, and pins subscribed to rising and falling edges */
+static uint64_t enabled = 0;
+static uint64_t rising = -1ULL;
+static uint64_t falling = -1ULL;
+
+static pthread_mutex_t lock_state = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t thread = 0;
+static int enable = 0;
+
+/** Result of a poll cycle */
+struct cycle {
+	/** Number of the cycle */
+	unsigned long long number;
+	/** Pins read with diagnosis current enabled */
+	uint64_t measured;
+	/** Pins changed to HIGH, measured in this and the previous cycle */
+	uint64_t rising;
+	/** Pins changed to LOW, measured in this and the previous cycle */
+	uint64_t falling;
+	/** Levels of all measured pins */
+	uint64_t state;
+};
 
-unsigned char bank = 0;
+/** Completed poll cycles, waiting threads are woken by broadcast on cond_cycle */
+static pthread_mutex_t lock_cycle = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_cycle;
+static struct cycle history[HISTORY] = { };
+static unsigned long long cycles = 0;
+/** Number of explicit stops of the poll thread, aborts waiting threads */
+static unsigned long long stops = 0;
 
-pthread_mutex_t lock_state = PTHREAD_MUTEX_INITIALIZER;
-pthread_t thread = 0;
-int enable = 0;
+/** Number of threads waiting for each pin, and pins polled for waiting threads */
+static unsigned int watchers[MICA_GPIO_SIZE] = { };
+static uint64_t watched = 0;
 
-int event_in = 0,
-event_out = 0;
-int waiting = 0;
+static pthread_mutex_t lock_spi = PTHREAD_MUTEX_INITIALIZER;
+/** Poll thread waits for lock_spi, other threads taking it wait on cond_spi until it has been handed over */
+static int claiming = 0;
+static pthread_cond_t cond_spi;
 
-pthread_mutex_t lock_spi = PTHREAD_MUTEX_INITIALIZER;
+static int connected = 0;
+static struct timespec disconnected;
+/** Switches have been detected on the device, not before it has been opened once */
+static int detected = 0;
+
+/** Role in sharing the device with other processes */
+static enum broker_role broker = BROKER_NONE;
+
+/**
+ * Held shared by threads of a client changing direction and enable and forwarding them to the owner, and exclusively
+ * while adopting the directions and enable published by the owner, so changes in progress are not overwritten
+ */
+static pthread_rwlock_t lock_shared = PTHREAD_RWLOCK_INITIALIZER;
 
-hid_device* device = NULL;
+/** Input control register of each switch, and diagnosis current enable of all pins */
+static unsigned short icr[SWITCHES] = { };
+static uint64_t dccr = 0;
 
-unsigned short icr = 0;
-unsigned char dccr = 0;
+/**
+ * Configurations set by mica_gpio_set_config, double-buffered. The writer fills the buffer not published last and
+ * swaps it in as pending, the poll thread takes the pending buffer at the start of its next cycle. A buffer is only
+ * refilled once the poll thread no longer copies it (taking).
+ */
+static pthread_mutex_t lock_config = PTHREAD_MUTEX_INITIALIZER;
+static struct mica_gpio_config configs[2];
+static int filling = 0;
+static struct mica_gpio_config *pending = NULL;
+static struct mica_gpio_config *taking = NULL;
+
+/** SPI transfer settings, the active chip select value is replaced when selecting a switch */
+static transfer_setting spi_settings = { //
+		.bit_rate = 5000000, // Bit rate
+				.idle_chip_select_value = 511, //
+				.active_chip_select_value = CHIP_SELECT, //
+				.chip_select_to_data_delay = 0, //
+				.last_data_byte_to_cs = 0, //
+				.delay_between_subsequent_data_bytes = 0, //
+				.bytes_to_transfer_per_spi_transaction = 1, //
+				.spi_mode = 1 };
+
+/** Real-time settings applied to the poll thread on creation */
+static struct mica_gpio_realtime realtime = { .policy = SCHED_OTHER, .priority = 0, .cpu = -1, .lock_memory = 0 };
+
+static pthread_mutex_t lock_statistics = PTHREAD_MUTEX_INITIALIZER;
+static struct mica_gpio_statistics statistics = { .period_min = -1ULL, .bit_rate = 5000000 };
 
 struct refer {
 	mica_gpio_callback callback;
+	/** Callback receiving sample times, replaces callback if set */
+	mica_gpio_timed_callback timed;
 	void *data;
+	struct mica_gpio_realtime realtime;
 };
 typedef struct refer refer;
 
-void _mica_gpio_list() {
-	struct hid_device_info *devs, *cur_dev;
+/** Listener added by mica_gpio_add_listener */
+struct listener {
+	int handle;
+	mica_gpio_callback callback;
+	/** Callback receiving sample times, replaces callback if set */
+	mica_gpio_timed_callback timed;
+	void *data;
+	/** Events passed to the own thread of the listener, NULL if called by the poll thread */
+	struct mica_gpio_event *queue;
+	/** Sample times of the queued events, for a timed listener */
+	struct mica_gpio_timestamp *stamps;
+	unsigned int capacity;
+	/** Positions of the next event to take and to queue */
+	unsigned int head;
+	unsigned int tail;
+	/** Thread waits for events */
+	int sleeping;
+	int enable;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/** Snapshot of all listeners, never changed once published */
+struct listeners {
+	int count;
+	/** Listener removed by replacing this snapshot, freed with it */
+	struct listener *removed;
+	/** Next snapshot waiting to be freed */
+	struct listeners *next;
+	struct listener *items[];
+};
+
+/** Current snapshot, replaced by writers holding lock_listeners, NULL without listeners */
+static pthread_mutex_t lock_listeners = PTHREAD_MUTEX_INITIALIZER;
+static struct listeners *listeners = NULL;
+static int handles = 0;
+/** Incremented by the poll thread on entering and leaving the listeners, odd while calling them */
+static unsigned long long epoch = 0;
+/** Snapshots replaced from within a listener called by the poll thread, freed once it has left the listeners */
+static struct listeners *retired = NULL;
+/** Poll thread is calling listeners */
+static __thread int dispatching = 0;
+/** Calling thread is the poll thread */
+static __thread int polling = 0;
+/** Listener whose queue is served by the calling thread */
+static __thread struct listener *serving = NULL;
+
+/**
+ * Takes lock_spi, after the poll thread if it is waiting for it
+ */
+void _mica_gpio_lock_spi() {
+	pthread_mutex_lock(&lock_spi);
+	while (__atomic_load_n(&claiming, __ATOMIC_RELAXED))
+		pthread_cond_wait(&cond_spi, &lock_spi);
+}
+
+/**
+ * Takes lock_spi for the batches of a poll cycle. A mutex does not queue its waiters, so a thread releasing and
+ * taking it again in a loop could keep the poll thread waiting for a long time. Instead the lock is handed over to
+ * the poll thread, other threads wait until it has been taken.
+ */
+void _mica_gpio_claim_spi() {
+	__atomic_store_n(&claiming, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&lock_spi);
+	__atomic_store_n(&claiming, 0, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&cond_spi);
+}
 
-	devs = hid_enumerate(0x0, 0x0);
-	cur_dev = devs;
-	while (cur_dev) {
-		printf("mica_gpio Device Found\n  type: %04hx %04hx\n  path: %s\n  serial_number: %ls", cur_dev->vendor_id, cur_dev->product_id, cur_dev->path,
-				cur_dev->serial_number);
-		printf("\n");
-		printf("  Manufacturer: %ls\n", cur_dev->manufacturer_string);
-		printf("  Product:      %ls\n", cur_dev->product_string);
-		printf("  Release:      %hx\n", cur_dev->release_number);
-		printf("  Interface:    %d\n", cur_dev->interface_number);
-		printf("\n");
-		cur_dev = cur_dev->next;
+/**
+ * Marks the device as lost after the transport failed
+ */
+void _mica_gpio_lost() {
+	if (__atomic_load_n(&connected, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&connected, 0, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&lock_statistics);
+		clock_gettime(CLOCK_MONOTONIC, &disconnected);
+		pthread_mutex_unlock(&lock_statistics);
 	}
-	hid_free_enumeration(devs);
+}
+
+/**
+ * Write report to the device
+ */
+int _mica_gpio_write(const unsigned char *data, size_t length) {
+	PROBE1(hid_write, data[1]);
+	int result = _mica_gpio_transport_write(data, length);
+	PROBE1(hid_write_done, result);
+	if (result < 0)
+		_mica_gpio_lost();
+	return result;
+}
+
+/**
+ * Read report from the device
+ */
+int _mica_gpio_read(unsigned char *data, size_t length, int timeout) {
+	PROBE1(hid_read, timeout);
+	int result = _mica_gpio_transport_read(data, length, timeout);
+	PROBE2(hid_read_done, result, data[0]);
+	if (result < 0)
+		_mica_gpio_lost();
+	return result;
 }
 
 /**
@@ -154,38 +381,164 @@ void _mica_gpio_print_chip_settings(chip_setting *chip_setting) {
 }
 
 /**
- * Get Power-up Chip Settings
- * @returns
- *     0 Command Completed Successfully
- *    -1 Communication error occurs
+ * @returns nanoseconds elapsed between start and end
  */
-int _mica_gpio_get_chip_settings(chip_setting *chip_setting) {
-	unsigned char cmd[65] = { 0x00, // report count
-			0x61, // Get NVRAM Settings - command code
-			0x20 // Get Power-up Chip Settings - sub-command code
-			};
-	int result;
+unsigned long long _mica_gpio_elapsed(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL + end->tv_nsec - start->tv_nsec;
+}
 
-	result = hid_write(device, cmd, 65);
-	if (result < 0)
-		return -1;
+/**
+ * @returns sample time taken between start and end, estimated in the middle
+ */
+struct mica_gpio_timestamp _mica_gpio_window(const struct timespec *start, const struct timespec *end) {
+	unsigned long long uncertainty = _mica_gpio_elapsed(start, end) / 2;
+	struct mica_gpio_timestamp result = { .time = start->tv_sec * 1000000000ULL + start->tv_nsec + uncertainty, .uncertainty = uncertainty };
+	return result;
+}
 
-	unsigned char buffer[64] = { };
+/** Report template of a HID command */
+struct command {
+	/** Start of the report, with report number, command code and sub-command code */
+	unsigned char report[3];
+	/** Offset of the command data in the report */
+	unsigned char offset;
+	/** Offset of the data length in the report, 0 if none */
+	unsigned char length;
+	/** Failures are counted only, not written to stdout */
+	unsigned char quiet;
+	/** Name for error messages */
+	const char *name;
+};
 
-	result = 0;
-	while (result == 0) {
-		result = hid_read(device, buffer, sizeof(buffer));
-	}
+/** Templates of all HID commands, indexed by enum MICA_GPIO_COMMAND */
+static const struct command commands[MICA_GPIO_COMMANDS] = { //
+		[COMMAND_CHIP_SETTINGS_GET] = { { 0x00, 0x61, 0x20 }, 0, 0, 0, "Get Chip Settings" }, //
+		[COMMAND_CHIP_SETTINGS_SET] = { { 0x00, 0x60, 0x20 }, 5, 0, 0, "Set Chip Settings" }, //
+		[COMMAND_TRANSFER_SETTINGS_GET] = { { 0x00, 0x61, 0x10 }, 0, 0, 0, "Get Transfer Settings" }, //
+		[COMMAND_TRANSFER_SETTINGS_SET] = { { 0x00, 0x60, 0x10 }, 5, 0, 0, "Set Transfer Settings" }, //
+		[COMMAND_SPI_SETTINGS_SET] = { { 0x00, 0x40 }, 5, 0, 1, "Set SPI Transfer Settings" }, //
+		[COMMAND_SPI_TRANSFER] = { { 0x00, 0x42 }, 5, 2, 1, "Transfer SPI Data" }, //
+		[COMMAND_CURRENT_CHIP_SETTINGS_SET] = { { 0x00, 0x21 }, 5, 0, 0, "Set Current Chip Settings" }, //
+		[COMMAND_INTERRUPT_EVENTS_GET] = { { 0x00, 0x12 }, 2, 0, 1, "Get Interrupt Events" } };
+
+/**
+ * Build report of command with length bytes of data
+ */
+void _mica_gpio_report(unsigned char *cmd, enum MICA_GPIO_COMMAND command, const void *data, size_t length) {
+	const struct command *template = &commands[command];
+	memset(cmd, 0, 65);
+	memcpy(cmd, template->report, sizeof(template->report));
+	if (template->length)
+		cmd[template->length] = length;
+	if (length > 0)
+		memcpy(&cmd[template->offset], data, length);
+}
 
-	if (buffer[0] == 0x61 && buffer[1] == 0x00 && buffer[2] == 0x20) {
-		// Command Completed Successfully
-		memcpy(chip_setting, &buffer[4], sizeof(*chip_setting));
+/**
+ * Decode status of the response to command
+ * @returns
+ *     0 Command Completed Successfully
+ *    -1 Response does not match the command
+ *    -4 Blocked Access
+ *    -7 Transfer in Progress
+ *    -8 SPI bus not available (the external owner has control over it)
+ */
+int _mica_gpio_decode(enum MICA_GPIO_COMMAND command, const unsigned char *buffer) {
+	if (buffer[0] != commands[command].report[1])
+		return -1;
+	switch (buffer[1]) {
+	case 0x00:
 		return 0;
+	case 0xf7:
+		return -8;
+	case 0xf8:
+		return -7;
+	case 0xfb:
+		return -4;
 	}
-	printf("ERROR: Get Chip Settings (%x, %x, %x)", buffer[0], buffer[1], buffer[2]);
 	return -1;
 }
 
+/**
+ * Adds latency of a command to its statistics
+ */
+void _mica_gpio_count_command(struct mica_gpio_command_statistics *command, unsigned long long latency) {
+	command->count++;
+	command->latency_sum += latency;
+	if (latency > command->latency_max)
+		command->latency_max = latency;
+}
+
+/**
+ * Send command with length bytes of data and wait for its response. Busy responses are retried up to BUSY_RETRIES
+ * times with exponential backoff starting at BACKOFF. Responses not matching the command are left over from an
+ * aborted transfer and discarded. Without response within TIMEOUT the device is considered lost.
+ * @returns
+ *     0 Command Completed Successfully, buffer holds the response
+ *    -1 Communication error occurs
+ *    -4 Blocked Access
+ *    -7 Transfer in Progress
+ *    -8 SPI bus not available (the external owner has control over it)
+ */
+int _mica_gpio_transact(enum MICA_GPIO_COMMAND command, const void *data, size_t length, unsigned char *buffer) {
+	unsigned char cmd[65];
+	struct timespec start, end, backoff = { .tv_nsec = BACKOFF };
+	int result, retries = 0, timeout = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	_mica_gpio_report(cmd, command, data, length);
+	for (;;) {
+		result = -1;
+		if (_mica_gpio_write(cmd, sizeof(cmd)) < 0)
+			break;
+		for (int discarded = 0; result == -1 && discarded <= 2 * IN_FLIGHT; discarded++) {
+			int read = _mica_gpio_read(buffer, 64, TIMEOUT);
+			if (read <= 0) {
+				if (read == 0) {
+					timeout = 1;
+					_mica_gpio_lost();
+				}
+				break;
+			}
+			if (buffer[0] == commands[command].report[1])
+				result = _mica_gpio_decode(command, buffer);
+		}
+		if ((result != -7 && result != -8) || retries == BUSY_RETRIES)
+			break;
+		retries++;
+		nanosleep(&backoff, NULL);
+		backoff.tv_nsec *= 2;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&lock_statistics);
+	struct mica_gpio_command_statistics *stats = &statistics.commands[command];
+	_mica_gpio_count_command(stats, _mica_gpio_elapsed(&start, &end));
+	stats->retries += retries;
+	stats->timeouts += timeout;
+	if (result < 0)
+		stats->failures++;
+	pthread_mutex_unlock(&lock_statistics);
+
+	if (result < 0 && !commands[command].quiet)
+		printf("ERROR: %s (%d)\n", commands[command].name, result);
+	return result;
+}
+
+/**
+ * Get Power-up Chip Settings
+ * @returns
+ *     0 Command Completed Successfully
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_get_chip_settings(chip_setting *chip_setting) {
+	unsigned char buffer[64];
+	if (_mica_gpio_transact(COMMAND_CHIP_SETTINGS_GET, NULL, 0, buffer) < 0)
+		return -1;
+	memcpy(chip_setting, &buffer[4], sizeof(*chip_setting));
+	return 0;
+}
+
 /**
  * Set Chip Settings Settings Power-up Default
  * @returns
@@ -194,41 +547,33 @@ int _mica_gpio_get_chip_settings(chip_setting *chip_setting) {
  *    -4 Blocked Access - The provided password is not matching the one stored in the chip, or the settings are permanently locked.
  */
 int _mica_gpio_set_chip_settings(chip_setting *chip_setting) {
-	unsigned char cmd[65] = { 0x00, // report count
-			0x60, // Set Chip NVRAM Parameters - command code
-			0x20, // Set Chip Settings Power-up Default - sub-command code
-			0x00, // Reserved
-			0x00  // Reserved
-			};
-
-	memcpy(&cmd[5], chip_setting, sizeof(*chip_setting));
+	unsigned char buffer[64];
+	int result = _mica_gpio_transact(COMMAND_CHIP_SETTINGS_SET, chip_setting, sizeof(*chip_setting), buffer);
+	return result == -4 ? -4 : result < 0 ? -1 : 0;
+}
 
-	int result;
+/**
+ * Set current Chip Settings, effective immediately
+ * @returns
+ *     0 Command Completed Successfully - settings written
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_set_current_chip_settings(chip_setting *chip_setting) {
+	unsigned char buffer[64];
+	return _mica_gpio_transact(COMMAND_CURRENT_CHIP_SETTINGS_SET, chip_setting, sizeof(*chip_setting), buffer) < 0 ? -1 : 0;
+}
 
-	result = hid_write(device, cmd, 65);
-	if (result < 0)
+/**
+ * Read and reset number of events counted on the interrupt pin
+ * @returns
+ *     number of events
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_get_interrupt_events() {
+	unsigned char buffer[64], reset = 0x00;
+	if (_mica_gpio_transact(COMMAND_INTERRUPT_EVENTS_GET, &reset, 1, buffer) < 0)
 		return -1;
-
-	unsigned char buffer[64] = { };
-	result = 0;
-	while (result == 0) {
-		result = hid_read(device, buffer, sizeof(buffer));
-	}
-
-	switch (buffer[0]) {
-	case 0x60:
-		switch (buffer[1]) {
-		case 0xfb:
-			// Blocked Access - The provided password is not matching the one stored in the chip, or the settings are permanently locked.
-			return -4;
-		case 0x00:
-			// Command Completed Successfully - settings written
-			if (buffer[2] == 0x20)
-				return 0;
-		}
-	}
-	printf("ERROR: Set Chip Settings (%x, %x, %x)", buffer[0], buffer[1], buffer[2]);
-	return -1;
+	return buffer[4] | buffer[5] << 8;
 }
 
 /**
@@ -254,34 +599,11 @@ void _mica_gpio_print_transfer_settings(transfer_setting *transfer_settings) {
  *    -1 Communication error occurs
  */
 int _mica_gpio_get_transfer_settings(transfer_setting *transfer_settings) {
-	unsigned char cmd[65] = { 0x00, // report count
-			0x61, // Get NVRAM Settings - command code
-			0x10 // Get SPI Power-up Transfer Settings - sub-command code
-			};
-	int result;
-
-	result = hid_write(device, cmd, 65);
-	if (result < 0)
+	unsigned char buffer[64];
+	if (_mica_gpio_transact(COMMAND_TRANSFER_SETTINGS_GET, NULL, 0, buffer) < 0)
 		return -1;
-
-	unsigned char buffer[64] = { };
-
-	result = 0;
-	while (result == 0) {
-		result = hid_read(device, buffer, sizeof(buffer));
-	}
-
-	switch (buffer[0]) {
-	case 0x61:
-		switch (buffer[1]) {
-		case 0x00:
-			// Command Completed Successfully
-			memcpy(transfer_settings, &buffer[4], sizeof(*transfer_settings));
-			return 0;
-		}
-	}
-	printf("ERROR: Get Transfer settings (%x, %x, %x)", buffer[0], buffer[1], buffer[2]);
-	return -1;
+	memcpy(transfer_settings, &buffer[4], sizeof(*transfer_settings));
+	return 0;
 }
 
 /**
@@ -293,212 +615,838 @@ int _mica_gpio_get_transfer_settings(transfer_setting *transfer_settings) {
  *    -7 USB Transfer in Progress - settings not written
  */
 int _mica_gpio_set_transfer_settings(transfer_setting *transfer_settings) {
+	unsigned char buffer[64];
+	int result = _mica_gpio_transact(COMMAND_TRANSFER_SETTINGS_SET, transfer_settings, sizeof(*transfer_settings), buffer);
+	return result == -4 || result == -7 ? result : result < 0 ? -1 : 0;
+}
 
-	unsigned char cmd[65] = { 0x00, // report count
-			0x60, // Set Chip NVRAM Parameters - command code
-			0x10, // Set SPI Power-up Transfer Settings - sub-command code
-			0x00, // Reserved
-			0x00, // Reserved
-			};
-
-	memcpy(&cmd[5], transfer_settings, sizeof(*transfer_settings));
-	int result;
-
-	result = hid_write(device, cmd, sizeof(cmd));
-	if (result < 0)
-		return -1;
+/**
+ * Select the switch with the given active chip select value for the following transfers
+ * @returns
+ *     0 Switch selected
+ *    -1 Communication error occurs
+ *    -7 Settings not written - SPI transfer in progress
+ */
+int _mica_gpio_select(unsigned short chip) {
+	if (selected == chip)
+		return 0;
 
-	unsigned char buffer[64] = { };
-	result = 0;
-	while (result == 0) {
-		result = hid_read(device, buffer, sizeof(buffer));
-	}
-
-	switch (buffer[0]) {
-	case 0x60:
-		switch (buffer[1]) {
-		case 0xfb:
-			// Blocked Access - Access password has not been provided or the settings are permanently locked.
-			return -4;
-		case 0xf8:
-			// USB Transfer in Progress - settings not written
-			return -7;
-		case 0x00:
-			// Command Completed Successfully - settings written
-			return 0;
-		}
-	}
-	printf("ERROR: Set transfer Settings (%x, %x, %x)", buffer[0], buffer[1], buffer[2]);
-	return -1;
+	transfer_setting settings = spi_settings;
+	settings.active_chip_select_value = chip;
+	unsigned char buffer[64];
+	int result = _mica_gpio_transact(COMMAND_SPI_SETTINGS_SET, &settings, sizeof(settings), buffer);
+	if (result == 0)
+		selected = chip;
+	return result == -7 ? -7 : result < 0 ? -1 : 0;
 }
 
 /**
  * Transfer data to SPI
  * @returns
- *     0 SPI data accepted - Command completed successfully
+ *     1 SPI data accepted - Command completed successfully
  *    -1 Communication error occurs
  *    -7 SPI data not accepted - SPI transfer in progress - cannot accept any data for the moment
  *    -8 SPI data not accepted - SPI bus not available (the external owner has control over it)
  */
 int _mica_gpio_transfer_to_spi(unsigned char request, unsigned char *response) {
+	if (!connected)
+		return -1;
 
-	if (device != NULL) {
-
-		unsigned char cmd[65] = { 0, // report count
-				0x42,   // Transfer SPI Data - command code
-				1,      // The number of bytes to be transferred in this packet
-				0x00,   // Reserved
-				0x00,   // Reserved
-				request // The SPI Data to be sent on the data transfer
-				};
-
-		int result;
-
-		result = hid_write(device, cmd, sizeof(cmd));
-		if (result < 0)
-			return -1;
+	unsigned char buffer[64];
+	PROBE2(register_send, selected, request);
+	int result = _mica_gpio_transact(COMMAND_SPI_TRANSFER, &request, 1, buffer);
+	// collect the received byte, a transfer of one byte needs a single status report
+	for (int i = 0; result == 0 && i < 4; i++) {
+		if (buffer[2] == 1 && response != NULL)
+			*response = buffer[4];
+		switch (buffer[3]) {
+		case 0x10:
+			// SPI transfer finished - no more data to send
+			PROBE3(register_done, selected, request, buffer[4]);
+			return 1;
+		case 0x20:
+			// SPI transfer started - no data to receive
+		case 0x30:
+			// SPI transfer not finished; receive data available
+			result = _mica_gpio_transact(COMMAND_SPI_TRANSFER, NULL, 0, buffer);
+			break;
+		default:
+			result = -1;
+		}
+	}
+	// SPI transfer failed or finished unexpectedly, no stdio on the poll loop path
+	pthread_mutex_lock(&lock_statistics);
+	statistics.errors++;
+	pthread_mutex_unlock(&lock_statistics);
+	return result < 0 ? result : -1;
+}
 
-		unsigned char buffer[64] = { };
-		result = 0;
-
-		while (result == 0) {
-			while (result == 0)
-				result = hid_read(device, buffer, sizeof(buffer));
-
-			switch (buffer[0]) {
-			case 0x42:
-				switch (buffer[1]) {
-				case 0xf7:
-					// SPI data not accepted - SPI bus not available (the external owner has control over it)
-					return -8;
-				case 0xf8:
-					// SPI data not accepted - SPI transfer in progress - cannot accept any data for the moment
-					return -7;
-				case 0x00:
-					// SPI data accepted - Command completed successfully
-					if (buffer[2] == 1 && response != NULL)
-						*response = buffer[4];
-					switch (buffer[3]) {
-					case 0x10:
-						// SPI transfer finished - no more data to send
-						return 1;
-					case 0x20: {
-						// SPI transfer started - no data to receive
-						unsigned char _cmd[65] = { 0, // report count
-								0x42 // Transfer SPI Data - command code
-								};
-						result = hid_write(device, _cmd, sizeof(_cmd));
-						if (result < 0)
-							return -1;
-						result = 0;
-						break;
-					}
-					case 0x30:
-						// SPI transfer not finished; receive data available
-						result = 0;
-						break;
-					}
-					break;
-				}
-			}
+/**
+ * Records number of SPI frames transferred since start, and latency of the reports exchanged
+ */
+void _mica_gpio_record_transfers(int count, const struct timespec *start, const struct mica_gpio_command_statistics *commands) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_mutex_lock(&lock_statistics);
+	statistics.transfers += count;
+	statistics.transfer_time += _mica_gpio_elapsed(start, &end);
+	if (commands) {
+		for (int i = 0; i < MICA_GPIO_COMMANDS; i++) {
+			struct mica_gpio_command_statistics *command = &statistics.commands[i];
+			command->count += commands[i].count;
+			command->latency_sum += commands[i].latency_sum;
+			if (commands[i].latency_max > command->latency_max)
+				command->latency_max = commands[i].latency_max;
 		}
-		printf("ERROR: SPI transfer finished unexpectedly (%x %x)\n\n", buffer[0], buffer[1]);
 	}
-	return -1;
+	pthread_mutex_unlock(&lock_statistics);
 }
 
-/*
+/** Reports of a batch transfer */
+enum report {
+	SELECT, // Set (VM) SPI Transfer Settings, selecting the switch of the next frame
+	START,  // Transfer SPI Data with the frame
+	FINISH  // Transfer SPI Data without data, collecting the received byte
+};
+
+/**
+ * Transfer sequence of frames to SPI, frame i is sent to switch chips[i]. Each frame is sent as Transfer SPI Data
+ * report followed by a status report collecting the received byte. Where the switch changes, a settings report
+ * selecting its chip select is inserted. Up to IN_FLIGHT reports are queued in the transport before the first
+ * response is read, except after a selection, which has to be confirmed before any frame is sent to the new switch.
+ * Latency of each report is accounted from its write to its response. Without response within TIMEOUT the device is
+ * considered lost. If the MCP 2210 does not respond as expected, the whole sequence is repeated frame by frame using
+ * transactions, which retry busy responses. Register writes are idempotent, but reading a diagnosis register clears
+ * its open load bits, so the repeated read may miss a failure already reported. The open load bits of answers to
+ * diagnosis register reads received without transmission error before the pipeline failed are merged into the
+ * answers of the repetition.
+ * Since SPI is full-duplex, responses[i] holds the answer of the switch to the frame before requests[i], if both
+ * were sent to the same switch. Unless stamps is NULL, frame i has been transferred between stamps[2 * i], when
+ * its report was written, and stamps[2 * i + 1], when its received byte was read.
  * @returns
- *    -1 if open the MCP 2210 device failed
+ *     1 SPI data accepted - Command completed successfully
+ *    -1 Communication error occurs
+ *    -7 SPI data not accepted - SPI transfer in progress - cannot accept any data for the moment
+ *    -8 SPI data not accepted - SPI bus not available (the external owner has control over it)
  */
-int _mica_gpio_init() {
-	printf("INFO: Initializing hardware ...\n");
-	fflush(stdout);
+int _mica_gpio_transfer_to_spi_timed(const unsigned char *chips, const unsigned char *requests, unsigned char *responses, int count,
+		struct timespec *stamps) {
+	if (!connected)
+		return -1;
 
-	pthread_mutex_init(&lock_spi, NULL);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	enum report kinds[count * 3];
+	int frames[count * 3], reports = 0;
+	unsigned short chip = selected;
+	for (int i = 0; i < count; i++) {
+		if (chip_select[chips[i]] != chip) {
+			chip = chip_select[chips[i]];
+			kinds[reports] = SELECT;
+			frames[reports++] = i;
+		}
+		kinds[reports] = START;
+		frames[reports++] = i;
+		kinds[reports] = FINISH;
+		frames[reports++] = i;
+	}
 
-	hid_init();
+	struct mica_gpio_command_statistics latency[MICA_GPIO_COMMANDS] = { };
+	struct timespec times[IN_FLIGHT], now;
+	int sent = 0, received = 0, result = 1;
+	unsigned char answered[count];
+	memset(answered, 0, count);
+	while (received < sent || (result == 1 && sent < reports)) {
+		while (result == 1 && sent < reports && sent - received < IN_FLIGHT && (sent == received || kinds[sent - 1] != SELECT)) {
+			unsigned char cmd[65];
+			int i = frames[sent];
+			switch (kinds[sent]) {
+			case SELECT: {
+				transfer_setting settings = spi_settings;
+				settings.active_chip_select_value = chip_select[chips[i]];
+				_mica_gpio_report(cmd, COMMAND_SPI_SETTINGS_SET, &settings, sizeof(settings));
+				break;
+			}
+			case START:
+				_mica_gpio_report(cmd, COMMAND_SPI_TRANSFER, &requests[i], 1);
+				PROBE2(register_send, chip_select[chips[i]], requests[i]);
+				break;
+			case FINISH:
+				_mica_gpio_report(cmd, COMMAND_SPI_TRANSFER, NULL, 0);
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &times[sent % IN_FLIGHT]);
+			if (stamps != NULL && kinds[sent] == START)
+				stamps[2 * i] = times[sent % IN_FLIGHT];
+			if (_mica_gpio_write(cmd, sizeof(cmd)) < 0)
+				return -1;
+			sent++;
+		}
 
-	// Open the device using the VID, PID and optionally the Serial number.
-	device = hid_open(0x2b9d, 0x8001, 0);
-	if (device == NULL)
-		return -1;
+		unsigned char buffer[64] = { };
+		int length = _mica_gpio_read(buffer, sizeof(buffer), TIMEOUT);
+		if (length <= 0) {
+			_mica_gpio_lost();
+			return -1;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		int i = frames[received];
+		enum MICA_GPIO_COMMAND command = kinds[received] == SELECT ? COMMAND_SPI_SETTINGS_SET : COMMAND_SPI_TRANSFER;
+		_mica_gpio_count_command(&latency[command], _mica_gpio_elapsed(&times[received % IN_FLIGHT], &now));
+		if (_mica_gpio_decode(command, buffer) < 0)
+			result = 0;
+		else {
+			switch (kinds[received]) {
+			case SELECT:
+				// settings written
+				selected = chip_select[chips[i]];
+				break;
+			case START:
+				// SPI transfer started - no data to receive
+				if (buffer[3] != 0x20)
+					result = 0;
+				break;
+			case FINISH:
+				// SPI transfer finished - no more data to send
+				if (buffer[2] == 1 && buffer[3] == 0x10) {
+					responses[i] = buffer[4];
+					answered[i] = 1;
+					if (stamps != NULL)
+						stamps[2 * i + 1] = now;
+					PROBE3(register_done, chip_select[chips[i]], requests[i], responses[i]);
+				} else
+					result = 0;
+				break;
+			}
+		}
+		received++;
+	}
 
-	// Set the hid_read() function to be non-blocking.
-	hid_set_nonblocking(device, 0);
+	if (result == 0) {
+		// pipeline out of sync, repeat sequence frame by frame
+		unsigned char first[count];
+		memcpy(first, responses, count);
+		selected = 0;
+		for (int i = 0; i < count; i++) {
+			result = _mica_gpio_select(chip_select[chips[i]]);
+			if (stamps != NULL)
+				clock_gettime(CLOCK_MONOTONIC, &stamps[2 * i]);
+			if (result == 0)
+				result = _mica_gpio_transfer_to_spi(requests[i], &responses[i]);
+			if (result < 0)
+				return result;
+			// the first read of a diagnosis register cleared its open load bits, keep what it reported
+			int previous = i - 1;
+			while (previous >= 0 && chips[previous] != chips[i])
+				previous--;
+			if (previous >= 0 && answered[i] && !(first[i] & TER) && !(requests[previous] & WRITE)
+					&& (requests[previous] & DIAG))
+				responses[i] |= first[i] & OL;
+			if (stamps != NULL)
+				clock_gettime(CLOCK_MONOTONIC, &stamps[2 * i + 1]);
+		}
+	}
+	_mica_gpio_record_transfers(count, &start, latency);
+	return 1;
+}
 
-	_mica_gpio_transfer_to_spi(CMD | WAKE, NULL);
+/**
+ * Transfer sequence of frames to SPI, see _mica_gpio_transfer_to_spi_timed
+ */
+int _mica_gpio_transfer_to_spi_batch(const unsigned char *chips, const unsigned char *requests, unsigned char *responses, int count) {
+	return _mica_gpio_transfer_to_spi_timed(chips, requests, responses, count, NULL);
+}
 
-	// set chip settings
-	chip_setting chip_setting = { //
+/**
+ * Fill chip settings with GP1-GP8 as chip selects, and GP6 as interrupt pin if interrupt is set
+ */
+void _mica_gpio_chip_settings(chip_setting *chip_setting, int interrupt) {
+	*chip_setting = (struct chip_setting) { //
 			.gp_pin_designation = { 1, 1, 1, 1, 1, 1, 1, 1, 1 }, //
 					.default_gpio_output = 0x1ff, // 0b111111111
 					.default_gpio_direction = 0x0, // 0b000000000
 					.other_chip_settings = 0x12, // [b4=1] Wake-up Enabled, [b3-1=001] Count Falling Edges, [b0=1]SPI Bus is released Between Transfer
 					.nvram_chip_parameters_access_control = 0x00 };
+	if (interrupt)
+		chip_setting->gp_pin_designation[INTERRUPT] = 2;
+}
+
+/**
+ * @returns 1 if the power-up chip settings equal chip_setting, the password is not compared as it cannot be read
+ */
+int _mica_gpio_stored_chip_settings(const chip_setting *chip_setting) {
+	struct chip_setting stored;
+	if (_mica_gpio_get_chip_settings(&stored) < 0)
+		return 0;
+	return memcmp(stored.gp_pin_designation, chip_setting->gp_pin_designation, sizeof(stored.gp_pin_designation)) == 0
+			&& stored.default_gpio_output == chip_setting->default_gpio_output
+			&& stored.default_gpio_direction == chip_setting->default_gpio_direction
+			&& stored.other_chip_settings == chip_setting->other_chip_settings
+			&& stored.nvram_chip_parameters_access_control == chip_setting->nvram_chip_parameters_access_control;
+}
+
+/**
+ * @returns 1 if the power-up transfer settings equal transfer_settings
+ */
+int _mica_gpio_stored_transfer_settings(const transfer_setting *transfer_settings) {
+	transfer_setting stored;
+	if (_mica_gpio_get_transfer_settings(&stored) < 0)
+		return 0;
+	return stored.bit_rate == transfer_settings->bit_rate && stored.idle_chip_select_value == transfer_settings->idle_chip_select_value
+			&& stored.active_chip_select_value == transfer_settings->active_chip_select_value
+			&& stored.chip_select_to_data_delay == transfer_settings->chip_select_to_data_delay
+			&& stored.last_data_byte_to_cs == transfer_settings->last_data_byte_to_cs
+			&& stored.delay_between_subsequent_data_bytes == transfer_settings->delay_between_subsequent_data_bytes
+			&& stored.bytes_to_transfer_per_spi_transaction == transfer_settings->bytes_to_transfer_per_spi_transaction
+			&& stored.spi_mode == transfer_settings->spi_mode;
+}
+
+/**
+ * Write chip settings, with GP6 as interrupt pin if not needed as chip select. They take effect at once, and are
+ * stored as power-up default if store is set and the stored ones differ, sparing the NVRAM on every other start.
+ */
+void _mica_gpio_configure_chip(int store) {
+	chip_setting chip_setting;
+	_mica_gpio_chip_settings(&chip_setting, interrupts);
 
-	_mica_gpio_set_chip_settings(&chip_setting);
+	_mica_gpio_set_current_chip_settings(&chip_setting);
+	if (store && !_mica_gpio_stored_chip_settings(&chip_setting))
+		_mica_gpio_set_chip_settings(&chip_setting);
 
 //	_mica_gpio_get_chip_settings(&chip_setting);
 //	_mica_gpio_print_chip_settings(&chip_setting);
+}
+
+/**
+ * Write chip settings, and store them and the transfer settings as power-up default if store is set and they differ.
+ * The transfer settings in effect are written with each selection of a switch.
+ */
+void _mica_gpio_configure(int store) {
+	_mica_gpio_configure_chip(store);
 
 	// set transfer settings
-	transfer_setting transfer_settings = { //
-			.bit_rate = 5000000, // Bit rate
-					.idle_chip_select_value = 511, //
-					.active_chip_select_value = 1, //
-					.chip_select_to_data_delay = 0, //
-					.last_data_byte_to_cs = 0, //
-					.delay_between_subsequent_data_bytes = 0, //
-					.bytes_to_transfer_per_spi_transaction = 1, //
-					.spi_mode = 1 };
-
-	_mica_gpio_set_transfer_settings(&transfer_settings);
-
-	printf("INFO: Initialization finished...\n");
-	fflush(stdout);
+	transfer_setting transfer_settings = spi_settings;
+
+	if (store && !_mica_gpio_stored_transfer_settings(&transfer_settings))
+		_mica_gpio_set_transfer_settings(&transfer_settings);
+
+	// select a switch with the current settings before the next transfer
+	selected = 0;
 
 //	_mica_gpio_get_transfer_settings(&transfer_settings);
 //	_mica_gpio_print_transfer_settings(&transfer_settings);
-
-	return 0;
 }
 
-void _mica_gpio_destroy() {
-	if (device != NULL)
-		hid_close(device);
-	device = NULL;
-
-	/* Free static HIDAPI objects. */
-	hid_exit();
-
-	pthread_mutex_destroy(&lock_spi);
+/**
+ * Detects SPI switches on chip selects GP1-GP8 (active low). Each switch is woken up, and a diagnosis current enable
+ * register is written, read back and cleared. If no switch answers, a single switch selected by the power-up chip
+ * select value is assumed, as wired on boards with eight pins.
+ */
+void _mica_gpio_detect() {
+	int found = 0;
+	for (int i = 0; i < SWITCHES; i++) {
+		unsigned char chips[5] = { found, found, found, found, found }, response[5];
+		unsigned char cmd[5] = { CMD | WAKE, WRITE + (DCCR << 4) + 5, READ + (DCCR << 4) + CONTR, 0, WRITE + (DCCR << 4) };
+		chip_select[found] = 0x1ff & ~(2 << i);
+		if (_mica_gpio_transfer_to_spi_batch(chips, cmd, response, 5) == 1 && (response[3] & 0xf) == 5)
+			found++;
+	}
+	if (found == 0) {
+		unsigned char chip = 0, cmd = CMD | WAKE, response;
+		chip_select[found++] = CHIP_SELECT;
+		_mica_gpio_transfer_to_spi_batch(&chip, &cmd, &response, 1);
+	}
+	switches = found;
+	size = found * MICA_GPIO_CHANNELS;
 }
 
-__attribute__((constructor)) void init(void) {
-	pthread_mutex_lock(&lock_state);
+/**
+ * Apply SPI bit rate and delays, taking effect with the next selection of a switch, lock_spi must be held
+ */
+void _mica_gpio_set_rate(unsigned int rate, unsigned short delay) {
+	spi_settings.bit_rate = rate;
+	spi_settings.chip_select_to_data_delay = delay;
+	spi_settings.last_data_byte_to_cs = delay;
+	spi_settings.delay_between_subsequent_data_bytes = delay;
+	selected = 0;
+	pthread_mutex_lock(&lock_statistics);
+	statistics.bit_rate = rate;
+	pthread_mutex_unlock(&lock_statistics);
+}
 
-	event_in = eventfd(0, 0);
-	event_out = eventfd(0, 0);
+/**
+ * Verify the current SPI settings. Test patterns are written to the first diagnosis current enable register of
+ * each switch and read back, no response may report a transmission error. Diagnosis current enable is restored.
+ * @returns
+ *     1 All patterns echoed without transmission error
+ *     0 Pattern mismatch or transmission error
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_verify() {
+	static const unsigned char patterns[] = { 0x5, 0xa, 0xf, 0x0 };
+	unsigned char chips[9], cmd[9], response[9];
+	int result = 1;
+	for (int r = 0; r < REPEAT && result == 1; r++) {
+		for (int s = 0; s < switches && result == 1; s++) {
+			// write and read back each pattern, the last answer arrives with the dummy frame
+			for (int i = 0; i < 4; i++) {
+				cmd[i * 2] = WRITE + (DCCR << 4) + patterns[i];
+				cmd[i * 2 + 1] = READ + (DCCR << 4) + CONTR;
+			}
+			cmd[8] = 0;
+			memset(chips, s, sizeof(chips));
+			if (_mica_gpio_transfer_to_spi_batch(chips, cmd, response, 9) < 0)
+				result = -1;
+			for (int i = 1; i < 9 && result == 1; i++)
+				if (response[i] & TER)
+					result = 0;
+			for (int i = 0; i < 4 && result == 1; i++)
+				if ((response[i * 2 + 2] & 0xf) != patterns[i])
+					result = 0;
+		}
+	}
 
-	_mica_gpio_init();
+	uint64_t diagnosis = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED);
+	for (int s = 0; s < switches; s++) {
+		for (int i = 0; i < 2; i++)
+			cmd[i] = WRITE + ((DCCR + i) << 4) + ((diagnosis >> (s * 8 + i * 4)) & 0xf);
+		memset(chips, s, 2);
+		_mica_gpio_transfer_to_spi_batch(chips, cmd, response, 2);
+	}
+	return result;
+}
 
-	memset(pins, -1, sizeof(pins));
-	pthread_mutex_unlock(&lock_state);
+/**
+ * Walk bit rates from the fastest and delays from none, and apply the first setting verified without errors,
+ * lock_spi must be held. The setting is stored as power-up default, so it is used after the next start.
+ * @returns
+ *     bit rate applied (bit/s)
+ *    -1 No setting verified, previous setting kept
+ */
+int _mica_gpio_calibrate() {
+	transfer_setting previous = spi_settings;
+	for (int i = 0; i < RATES && connected; i++) {
+		for (int delay = 0; delay < DELAYS && connected; delay++) {
+			_mica_gpio_set_rate(rates[i], delay);
+			if (_mica_gpio_verify() == 1) {
+				transfer_setting transfer_settings = spi_settings;
+				transfer_settings.active_chip_select_value = CHIP_SELECT;
+				_mica_gpio_set_transfer_settings(&transfer_settings);
+				selected = 0;
+				return rates[i];
+			}
+		}
+	}
+	_mica_gpio_set_rate(previous.bit_rate, previous.chip_select_to_data_delay);
+	return -1;
 }
 
-__attribute__((destructor)) void destroy(void) {
-	pthread_mutex_lock(&lock_state);
+/**
+ * Adopt bit rate and delays stored by an earlier calibration as power-up default
+ */
+void _mica_gpio_load_rate() {
+	transfer_setting stored;
+	if (_mica_gpio_get_transfer_settings(&stored) < 0)
+		return;
+	for (int i = 0; i < RATES; i++)
+		if (stored.bit_rate == rates[i] && stored.chip_select_to_data_delay < DELAYS)
+			_mica_gpio_set_rate(stored.bit_rate, stored.chip_select_to_data_delay);
+}
+
+/**
+ * Counts transmission errors of a poll cycle. Once a window has seen more than TER_LIMIT errors, the bit rate is
+ * lowered by one step, or the delays raised at the slowest rate.
+ */
+void _mica_gpio_check_errors(unsigned int errors) {
+	if (errors > 0) {
+		transmission_errors += errors;
+		pthread_mutex_lock(&lock_statistics);
+		statistics.transmission_errors += errors;
+		pthread_mutex_unlock(&lock_statistics);
+	}
+	if (++window < TER_WINDOW)
+		return;
+	if (transmission_errors > TER_LIMIT) {
+		_mica_gpio_lock_spi();
+		int i = 0;
+		while (i < RATES - 1 && rates[i] > spi_settings.bit_rate)
+			i++;
+		unsigned short delay = spi_settings.chip_select_to_data_delay;
+		int dropped = 1;
+		if (i < RATES - 1 && rates[i] == spi_settings.bit_rate)
+			_mica_gpio_set_rate(rates[i + 1], delay);
+		else if (delay < DELAYS - 1)
+			_mica_gpio_set_rate(spi_settings.bit_rate, delay + 1);
+		else
+			dropped = 0;
+		pthread_mutex_unlock(&lock_spi);
+		if (dropped) {
+			pthread_mutex_lock(&lock_statistics);
+			statistics.rate_drops++;
+			pthread_mutex_unlock(&lock_statistics);
+		}
+	}
+	transmission_errors = 0;
+	window = 0;
+}
+
+/**
+ * @returns 1 if no chip select of the detected switches drives GP6, e.g. not the power-up value asserting GP1-GP8
+ */
+int _mica_gpio_interrupt_free() {
+	for (int s = 0; s < switches; s++)
+		if (!(chip_select[s] & (1 << INTERRUPT)))
+			return 0;
+	return 1;
+}
+
+/**
+ * Set up the device opened for the first time. The stored bit rate is adopted, the switches are detected, edges of
+ * the interrupt line are counted if GP6 is free, and the bit rate is recalibrated if needed. lock_spi must be held.
+ */
+void _mica_gpio_setup() {
+	_mica_gpio_load_rate();
+
+	// GP1-GP8 as chip selects for detection, in effect at once
+	chip_setting chip_setting;
+	_mica_gpio_chip_settings(&chip_setting, 0);
+	_mica_gpio_set_current_chip_settings(&chip_setting);
+
+	_mica_gpio_detect();
+
+	// count edges of the interrupt line, if GP6 is not needed as chip select
+	interrupts = _mica_gpio_interrupt_free();
+	_mica_gpio_configure(1);
+	if (interrupts)
+		_mica_gpio_get_interrupt_events();
+
+	// recalibrate if the stored setting does not work with the attached switches
+	if (_mica_gpio_verify() == 0 && _mica_gpio_calibrate() < 0)
+		printf("WARNING: SPI calibration failed, using %d bit/s\n", spi_settings.bit_rate);
+
+	// detect again on the next connect, if the device has been lost meanwhile
+	detected = connected;
+}
+
+void _mica_gpio_adopt(const struct broker_state *state);
+
+/*
+ * @returns
+ *    -1 if open the MCP 2210 device failed
+ */
+int _mica_gpio_init() {
+	printf("INFO: Initializing hardware ...\n");
+	fflush(stdout);
+
+	pthread_mutex_init(&lock_spi, NULL);
+
+	// follow the process owning the device, if any
+	broker = _mica_gpio_broker_open();
+	if (broker == BROKER_CLIENT) {
+		struct broker_state state;
+		if (_mica_gpio_broker_load(&state) < 0) {
+			// the owner stalled while publishing its state, take over if it died
+			if (_mica_gpio_broker_alive()) {
+				printf("WARNING: Owner of the shared device not responding, using the device exclusively\n");
+				_mica_gpio_broker_close();
+				broker = BROKER_NONE;
+			} else
+				broker = BROKER_OWNER;
+		} else if (state.size <= 0 || state.size > MICA_GPIO_SIZE || state.size % MICA_GPIO_CHANNELS != 0) {
+			printf("WARNING: Shared device reports invalid size %d, using the device exclusively\n", state.size);
+			_mica_gpio_broker_close();
+			broker = BROKER_NONE;
+		} else {
+			size = state.size;
+			switches = size / MICA_GPIO_CHANNELS;
+			_mica_gpio_adopt(&state);
+			__atomic_store_n(&connected, 1, __ATOMIC_RELAXED);
+			printf("INFO: Attached to shared device (%d pins)...\n", size);
+			fflush(stdout);
+			return 0;
+		}
+	}
+
+	// Open the device using the VID and PID, it is set up on the first connect if not available yet
+	if (_mica_gpio_transport_open(VENDOR_ID, PRODUCT_ID) < 0)
+		return -1;
+	__atomic_store_n(&connected, 1, __ATOMIC_RELAXED);
+
+	_mica_gpio_lock_spi();
+	_mica_gpio_setup();
+	pthread_mutex_unlock(&lock_spi);
+
+	printf("INFO: Initialization finished (%d pins)...\n", size);
+	fflush(stdout);
+
+	return 0;
+}
+
+/**
+ * Publishes state for clients sharing the device
+ */
+void _mica_gpio_share() {
+	struct broker_state state = { .size = size, .states = mica_gpio_get_states(), .dccr = __atomic_load_n(&dccr, __ATOMIC_RELAXED),
+			.enabled = __atomic_load_n(&enabled, __ATOMIC_RELAXED) };
+	for (int i = 0; i < size; i++)
+		switch (__atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED)) {
+		case OUTPUT:
+			state.outputs |= 1ULL << i;
+			break;
+		case INPUT:
+			state.inputs |= 1ULL << i;
+			break;
+		}
+	for (int s = 0; s < SWITCHES; s++)
+		state.icr[s] = __atomic_load_n(&icr[s], __ATOMIC_RELAXED);
+	memcpy(state.chip_select, chip_select, sizeof(state.chip_select));
+	pthread_mutex_lock(&lock_statistics);
+	state.statistics = statistics;
+	pthread_mutex_unlock(&lock_statistics);
+	_mica_gpio_broker_store(&state);
+}
+
+/**
+ * Take over the device after the owning process is gone. Outputs, diagnosis current enable and directions
+ * published by the owner are adopted, the device is opened and they are restored by the reconnect path.
+ */
+void _mica_gpio_takeover() {
+	struct broker_state state;
+	// sequences left odd by the owner are repaired, the state it was writing is adopted as far as written
+	_mica_gpio_broker_load(&state);
+	_mica_gpio_lock_spi();
+	for (int s = 0; s < SWITCHES; s++)
+		__atomic_store_n(&icr[s], state.icr[s], __ATOMIC_RELAXED);
+	memcpy(chip_select, state.chip_select, sizeof(chip_select));
+	__atomic_store_n(&dccr, state.dccr, __ATOMIC_RELAXED);
+	// the switches detected by the owner are kept
+	detected = 1;
+	interrupts = _mica_gpio_interrupt_free();
+	// keep the bit rate the owner has calibrated
+	if (state.statistics.bit_rate > 0)
+		_mica_gpio_set_rate(state.statistics.bit_rate, spi_settings.chip_select_to_data_delay);
+	pthread_mutex_unlock(&lock_spi);
+	for (int i = 0; i < size; i++)
+		if ((state.outputs >> i) & 1)
+			__atomic_store_n(&pins[i].direction, OUTPUT, __ATOMIC_RELAXED);
+	broker = BROKER_OWNER;
+	_mica_gpio_lost();
+}
+
+/**
+ * Send command to the process owning the device, waits while its queue is full
+ */
+void _mica_gpio_forward(enum broker_command command, int id, uint64_t mask, uint64_t value) {
+	struct broker_message message = { .command = command, .id = id, .mask = mask, .value = value };
+	const struct timespec req = { .tv_nsec = 1000000 };
+	for (int i = 0; _mica_gpio_broker_send(&message) < 0; i++) {
+		if (i == TIMEOUT) {
+			printf("WARNING: Command queue of the shared device full\n");
+			return;
+		}
+		nanosleep(&req, NULL);
+	}
+}
+
+/**
+ * Wake up all switches and replay the shadowed output and diagnosis registers in one batch, lock_spi must be held
+ * @returns result of the batch transfer
+ */
+int _mica_gpio_restore() {
+	unsigned char chips[SWITCHES * 7], cmd[SWITCHES * 7], response[SWITCHES * 7];
+	int count = 0;
+	uint64_t diagnosis = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED);
+	for (int s = 0; s < switches; s++) {
+		chips[count] = s;
+		cmd[count++] = CMD | WAKE;
+		for (int i = 0; i < 4; i++) {
+			chips[count] = s;
+			cmd[count++] = WRITE + (i << 4) + ((icr[s] >> (i * 4)) & 0xf);
+		}
+		for (int i = 0; i < 2; i++) {
+			chips[count] = s;
+			cmd[count++] = WRITE + ((DCCR + i) << 4) + ((diagnosis >> (s * 8 + i * 4)) & 0xf);
+		}
+	}
+	__atomic_store_n(&standby, 0, __ATOMIC_RELAXED);
+	return _mica_gpio_transfer_to_spi_batch(chips, cmd, response, count);
+}
+
+/**
+ * Reopen the device after it has been lost. Settings, WAKE and the shadowed output and diagnosis registers are
+ * replayed, the register writes in a single SPI batch. A device not available on initialization is set up first.
+ * @returns
+ *     1 Device opened for the first time, switches detected and state restored
+ *     0 Device reopened and state restored
+ *    -1 Device not available
+ */
+int _mica_gpio_reconnect() {
+	int result = -1;
+	_mica_gpio_lock_spi();
+	_mica_gpio_transport_close();
+	if (_mica_gpio_transport_open(VENDOR_ID, PRODUCT_ID) == 0) {
+		__atomic_store_n(&connected, 1, __ATOMIC_RELAXED);
+		int first = !detected;
+		if (first) {
+			_mica_gpio_setup();
+			printf("INFO: Device connected (%d pins)...\n", size);
+			fflush(stdout);
+		} else
+			// the power-up settings have been stored on setup already
+			_mica_gpio_configure(0);
+
+		if (connected && _mica_gpio_restore() >= 0)
+			result = first;
+		else
+			_mica_gpio_lost();
+	}
+	pthread_mutex_unlock(&lock_spi);
+	return result;
+}
+
+/**
+ * Records use of the device, and wakes up the switches from stand-by restoring their registers, lock_spi must be held
+ */
+void _mica_gpio_wake() {
+	clock_gettime(CLOCK_MONOTONIC, &active);
+	if (!standby || !connected)
+		return;
+	_mica_gpio_restore();
+	pthread_cond_broadcast(&cond_standby);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long time = _mica_gpio_elapsed(&active, &now);
+	pthread_mutex_lock(&lock_statistics);
+	statistics.wakeups++;
+	statistics.wake_time = time;
+	if (time > statistics.wake_time_max)
+		statistics.wake_time_max = time;
+	pthread_mutex_unlock(&lock_statistics);
+}
+
+/**
+ * Wakes up the switches before the device is used by an API call, not needed in a process following the owner
+ */
+void _mica_gpio_resume() {
+	if (broker == BROKER_CLIENT)
+		return;
+	_mica_gpio_lock_spi();
+	_mica_gpio_wake();
+	pthread_mutex_unlock(&lock_spi);
+}
+
+/**
+ * Puts the switches in stand-by, once no input has been enabled or watched and no output HIGH for the idle time
+ */
+void _mica_gpio_idle() {
+	long long quiet = __atomic_load_n(&idle, __ATOMIC_RELAXED);
+	if (quiet <= 0)
+		return;
+	_mica_gpio_lock_spi();
+	int busy = __atomic_load_n(&dccr, __ATOMIC_RELAXED) != 0 || __atomic_load_n(&watched, __ATOMIC_RELAXED) != 0;
+	for (int s = 0; s < switches; s++)
+		busy |= icr[s] != 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (busy)
+		active = now;
+	else if (connected && _mica_gpio_elapsed(&active, &now) >= quiet) {
+		unsigned char chips[SWITCHES], cmd[SWITCHES], response[SWITCHES];
+		for (int s = 0; s < switches; s++) {
+			chips[s] = s;
+			cmd[s] = CMD | STB;
+		}
+		if (_mica_gpio_transfer_to_spi_batch(chips, cmd, response, switches) == 1) {
+			__atomic_store_n(&standby, 1, __ATOMIC_RELAXED);
+			pthread_mutex_lock(&lock_statistics);
+			statistics.standbys++;
+			pthread_mutex_unlock(&lock_statistics);
+		}
+	}
+	pthread_mutex_unlock(&lock_spi);
+}
+
+void _mica_gpio_deadline(struct timespec *deadline, long long timeout);
+
+/**
+ * Waits in stand-by until woken up by an API call, at most STANDBY. Every STANDBY_CHECKS waits the interrupt counter
+ * is read, events counted wake up the switches.
+ */
+void _mica_gpio_doze(unsigned int *waits) {
+	struct timespec deadline;
+	_mica_gpio_deadline(&deadline, STANDBY);
+	_mica_gpio_lock_spi();
+	if (standby && __atomic_load_n(&enable, __ATOMIC_RELAXED))
+		pthread_cond_timedwait(&cond_standby, &lock_spi, &deadline);
+	if (standby && interrupts && connected && ++*waits % STANDBY_CHECKS == 0 && _mica_gpio_get_interrupt_events() > 0)
+		_mica_gpio_wake();
+	pthread_mutex_unlock(&lock_spi);
+}
+
+void _mica_gpio_destroy() {
+	_mica_gpio_broker_close();
+	_mica_gpio_transport_close();
+	_mica_gpio_transport_exit();
+	__atomic_store_n(&connected, 0, __ATOMIC_RELAXED);
+
+	pthread_mutex_destroy(&lock_spi);
+}
+
+void _mica_gpio_start(mica_gpio_callback callback, mica_gpio_timed_callback timed, void *data);
+
+__attribute__((constructor)) void init(void) {
+	pthread_mutex_lock(&lock_state);
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond_cycle, &attr);
+	pthread_cond_init(&cond_standby, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&cond_spi, NULL);
+
+	memset(pins, -1, sizeof(pins));
+
+	_mica_gpio_init();
+
+	// the owner publishes poll cycles, a client watches for the owner to go away
+	if (broker == BROKER_OWNER) {
+		_mica_gpio_share();
+		_mica_gpio_broker_ready();
+	}
+	if (broker != BROKER_NONE)
+		_mica_gpio_start(NULL, NULL, NULL);
+	pthread_mutex_unlock(&lock_state);
+}
+
+__attribute__((destructor)) void destroy(void) {
+	pthread_mutex_lock(&lock_state);
+
+	if (thread != 0) {
+		__atomic_store_n(&enable, 0, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&cond_standby);
+		pthread_join(thread, NULL);
+		thread = 0;
+	}
 
 	_mica_gpio_destroy();
 
-	close(event_in);
-	close(event_out);
+	pthread_cond_destroy(&cond_cycle);
+	pthread_cond_destroy(&cond_standby);
+	pthread_cond_destroy(&cond_spi);
 
 	pthread_mutex_unlock(&lock_state);
 }
 
-void _mica_gpio_set_diagnosis() {
+/**
+ * Write diagnosis current enable of enabled and watched pins of all switches, and clear registers of pins disabled
+ * since written was returned by the last call
+ * @returns pins with diagnosis current enabled
+ */
+uint64_t _mica_gpio_set_diagnosis(uint64_t written) {
 	// Write Register Command
 	// 1=Write
 	// |Address (ADDR)
@@ -508,20 +1456,24 @@ void _mica_gpio_set_diagnosis() {
 	// ||||Data
 	// ||||||||
 
-	pthread_mutex_lock(&lock_spi);
-	if (device != NULL) {
-
-		for (int i = 0; i < 2; i++) {
-			char value = (dccr >> (i * 4)) & 0xf;
-			if (value > 0) {
-				// 8th bit set for write command, bits 5 to 7 for address address, last 4 bits for channels
-				char cmd = WRITE + ((DCCR + i) << 4) + value;
-
-				_mica_gpio_transfer_to_spi(cmd, NULL);
-			}
+	// each switch has two registers of four pins
+	uint64_t diagnosis = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED);
+	unsigned char chips[SWITCHES * 2], cmd[SWITCHES * 2], response[SWITCHES * 2];
+	int count = 0;
+	for (int i = 0; i < switches * 2; i++) {
+		unsigned char value = (diagnosis >> (i * 4)) & 0xf;
+		if (value > 0 || ((written >> (i * 4)) & 0xf)) {
+			// 8th bit set for write command, bits 5 to 7 for address address, last 4 bits for channels
+			chips[count] = i / 2;
+			cmd[count++] = WRITE + ((DCCR + i % 2) << 4) + value;
 		}
 	}
+
+	_mica_gpio_claim_spi();
+	if (connected && count > 0)
+		_mica_gpio_transfer_to_spi_batch(chips, cmd, response, count);
 	pthread_mutex_unlock(&lock_spi);
+	return diagnosis;
 }
 
 /**
@@ -569,69 +1521,98 @@ void _mica_gpio_set_state(unsigned char id, enum MICA_GPIO_STATE state) {
 	// ||||Data
 	// ||||||||
 
+	// select the switch and its channel
+	unsigned char chip = id / MICA_GPIO_CHANNELS, channel = id % MICA_GPIO_CHANNELS;
+
 	// set state of pin and leave old setting for other pin of address bank
-	unsigned short tmp = (icr & ~(3 << (id * 2))) + (((state & 1) * 3) << (id * 2));
+	unsigned short tmp = (icr[chip] & ~(3 << (channel * 2))) + (((state & 1) * 3) << (channel * 2));
 
 	// set the address bank (two pins on each address bank)
-	unsigned char address = id / 2;
+	unsigned char address = channel / 2;
 
-	unsigned char cmd = WRITE + (address << 4) + ((tmp >> id / 2 * 4) & 0xf);
+	unsigned char cmd = WRITE + (address << 4) + ((tmp >> address * 4) & 0xf), response;
 
 	// transfer data to SPI
-	int result = _mica_gpio_transfer_to_spi(cmd, NULL);
+	int result = _mica_gpio_transfer_to_spi_batch(&chip, &cmd, &response, 1);
 
-	// remember state on success
-	if (result == 1)
-		icr = tmp;
+	// remember state on success, or replay it once a lost device is back
+	if (result == 1 || !connected)
+		__atomic_store_n(&icr[chip], tmp, __ATOMIC_RELAXED);
 }
 
 unsigned char _mica_gpio_get_enable(unsigned char id) {
-	return (dccr & (1 << id)) == (1 << id);
+	return (__atomic_load_n(&dccr, __ATOMIC_RELAXED) >> id) & 1;
 }
 
 void _mica_gpio_set_enable(unsigned char id, unsigned char enable) {
-	dccr = (dccr & ~(1 << id)) | ((enable & 1) << id);
+	if (enable & 1)
+		__atomic_or_fetch(&dccr, 1ULL << id, __ATOMIC_RELAXED);
+	else
+		__atomic_and_fetch(&dccr, ~(1ULL << id), __ATOMIC_RELAXED);
 }
 
-char _mica_gpio_await(struct pin pin, unsigned char id) {
-	int state = 0;
-	pthread_mutex_lock(&lock_state);
-	if (device == NULL) {
-		pthread_mutex_unlock(&lock_state);
-		sleep(1);
-		pthread_mutex_lock(&lock_state);
+/**
+ * Applies direction and enable of all pins at once
+ */
+void _mica_gpio_apply(const struct mica_gpio_config *config) {
+	for (int i = 0; i < size; i++) {
+		__atomic_store_n(&pins[i].direction, (config->outputs >> i) & 1 ? OUTPUT : INPUT, __ATOMIC_RELAXED);
+		__atomic_store_n(&pins[i].enabled, (int) ((config->enabled >> i) & 1), __ATOMIC_RELAXED);
 	}
-	if (enable) {
-		waiting = 1;
-
-		uint64_t u;
-		ssize_t n = read(event_in, &u, sizeof(uint64_t));
-		if (n != sizeof(uint64_t))
-			printf("Event reading error");
-
-		_mica_gpio_set_enable(id, 1);
-
-		n = write(event_out, &u, sizeof(uint64_t));
-		if (n != sizeof(uint64_t))
-			printf("Event writing error\n");
+	__atomic_store_n(&dccr, config->enabled, __ATOMIC_RELAXED);
+	__atomic_store_n(&enabled, config->enabled, __ATOMIC_RELAXED);
+}
 
-		n = read(event_in, &u, sizeof(uint64_t));
-		if (n != sizeof(uint64_t))
-			printf("Event reading error");
+/**
+ * Adopts directions and enable of all pins published by the owner (client)
+ */
+void _mica_gpio_adopt(const struct broker_state *state) {
+	for (int i = 0; i < size; i++) {
+		// pins without direction set by any process stay unset
+		enum MICA_GPIO_DIRECTION direction = (state->outputs >> i) & 1 ? OUTPUT : (state->inputs >> i) & 1 ? INPUT : -1;
+		__atomic_store_n(&pins[i].direction, direction, __ATOMIC_RELAXED);
+		__atomic_store_n(&pins[i].enabled, (int) ((state->enabled >> i) & 1), __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dccr, state->dccr, __ATOMIC_RELAXED);
+	__atomic_store_n(&enabled, state->enabled, __ATOMIC_RELAXED);
+}
 
-		state = bank >> id & 1;
-		waiting = 0;
-		_mica_gpio_set_enable(id, pin.enabled);
+/**
+ * Adopts changes of directions and enable made by other processes, once the owner has taken all commands of this
+ * process. Skipped while a thread of this process changes them.
+ */
+void _mica_gpio_follow() {
+	if (pthread_rwlock_trywrlock(&lock_shared) != 0)
+		return;
+	struct broker_state state;
+	if (_mica_gpio_broker_load(&state) == 0 && _mica_gpio_broker_served(&state))
+		_mica_gpio_adopt(&state);
+	pthread_rwlock_unlock(&lock_shared);
+}
 
-		n = write(event_out, &u, sizeof(uint64_t));
-		if (n != sizeof(uint64_t))
-			printf("Event writing error\n");
-	}
-	pthread_mutex_unlock(&lock_state);
-	return state;
+/**
+ * Applies the configuration pending from mica_gpio_set_config, if any (poll thread). The diagnosis current enable
+ * registers of all switches are written in one batch by _mica_gpio_set_diagnosis at the end of the cycle.
+ */
+void _mica_gpio_take_config() {
+	struct mica_gpio_config *config = __atomic_load_n(&pending, __ATOMIC_ACQUIRE);
+	if (config == NULL)
+		return;
+	__atomic_store_n(&taking, config, __ATOMIC_SEQ_CST);
+	// a buffer still pending is complete, the writer refills it only after replacing it and seeing taking unset
+	if (__atomic_compare_exchange_n(&pending, &config, NULL, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		_mica_gpio_apply(config);
+	__atomic_store_n(&taking, NULL, __ATOMIC_RELEASE);
 }
 
-void _mica_gpio_poll(unsigned char *data) {
+/**
+ * Read levels of pins with enabled or watched diagnosis of all switches, counting answers with transmission error.
+ * Banks answered with transmission error are left out of the result and read as LOW in data, the caller keeps their
+ * previous level. Events counted on the interrupt pin are read just before, -1 if not available. The sample time of
+ * each bank read is stored to sampled, indexed like the banks of two pins.
+ * @returns pins read
+ */
+uint64_t _mica_gpio_poll(uint64_t *data, unsigned int *errors, int *events, struct mica_gpio_timestamp *sampled) {
 	// Read Register Command
 	// 0=Read
 	// |Address (ADDR)
@@ -639,38 +1620,402 @@ void _mica_gpio_poll(unsigned char *data) {
 	// ||||||0=Read Register Command
 	// |||||||1=Diagnosis Register Bank
 	// ||||||||
-	pthread_mutex_lock(&lock_spi);
-	*data = 0;
-	for (int i = 0; i < 4; i++) {
-		if ((dccr >> (i * 2)) & 3) {
-			unsigned char tmp;
-			int result = _mica_gpio_read_diagnosis_register_bank(i, &tmp);
-			if (result >= 0) {
-				switch (tmp & 10) { // b1010 - open load mask
-				case 2:
-					*data += (1 << (i * 2));
-					break;
-				case 8:
-					*data += (2 << (i * 2));
-					break;
-				case 10:
-					*data += (3 << (i * 2));
-					break;
-				}
+	// read all enabled banks of all switches in one sweep, the answer to each read arrives with the next frame to
+	// the same switch, so each switch is closed by a dummy frame
+	uint64_t diagnosis = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED), polled = 0;
+	unsigned char chips[SWITCHES * 5], cmd[SWITCHES * 5], response[SWITCHES * 5], address[SWITCHES * 5];
+	int count = 0;
+	for (int s = 0; s < switches; s++) {
+		int first = count;
+		for (int i = 0; i < 4; i++) {
+			if ((diagnosis >> ((s * 4 + i) * 2)) & 3) {
+				chips[count] = s;
+				address[count] = s * 4 + i;
+				cmd[count++] = READ + (i << 4) + DIAG;
 			}
 		}
+		if (count > first) {
+			chips[count] = s;
+			address[count] = 0xff;
+			cmd[count++] = 0;
+		}
 	}
+	*data = 0;
+	*events = -1;
+	if (count == 0)
+		return 0;
+
+	PROBE1(poll, diagnosis);
+	_mica_gpio_claim_spi();
+	if (interrupts && connected)
+		*events = _mica_gpio_get_interrupt_events();
+	// the answer to a read is latched by its frame and shifted out by the next one, both frames bound the sample
+	struct timespec stamps[SWITCHES * 5 * 2];
+	int result = connected ? _mica_gpio_transfer_to_spi_timed(chips, cmd, response, count, stamps) : -1;
 	pthread_mutex_unlock(&lock_spi);
+
+	if (result >= 0) {
+		for (int j = 0; j < count; j++) {
+			if (address[j] == 0xff)
+				continue;
+			int i = address[j];
+			// the answer of a frame with transmission error is not used
+			if (response[j + 1] & TER) {
+				(*errors)++;
+				continue;
+			}
+			polled |= 3ULL << (i * 2);
+			sampled[i] = _mica_gpio_window(&stamps[2 * j], &stamps[2 * (j + 1) + 1]);
+			switch (response[j + 1] & OL) { // b1010 - open load mask
+			case 2:
+				*data += (1ULL << (i * 2));
+				break;
+			case 8:
+				*data += (2ULL << (i * 2));
+				break;
+			case 10:
+				*data += (3ULL << (i * 2));
+				break;
+			}
+		}
+	}
+	PROBE2(poll_done, polled, *errors);
+	return polled;
+}
+
+/**
+ * Adds period of the poll loop to time
+ */
+void _mica_gpio_advance(struct timespec *time) {
+	time->tv_nsec += __atomic_load_n(&period, __ATOMIC_RELAXED);
+	while (time->tv_nsec >= 1000000000) {
+		time->tv_nsec -= 1000000000;
+		time->tv_sec++;
+	}
+}
+
+/**
+ * Records period of the last poll cycle
+ */
+void _mica_gpio_record_period(unsigned long long period) {
+	unsigned long long slot = period / 1000000;
+	pthread_mutex_lock(&lock_statistics);
+	statistics.cycles++;
+	if (period < statistics.period_min)
+		statistics.period_min = period;
+	if (period > statistics.period_max)
+		statistics.period_max = period;
+	statistics.period_sum += period;
+	statistics.period_histogram[slot < MICA_GPIO_HISTOGRAM_SIZE ? slot : MICA_GPIO_HISTOGRAM_SIZE - 1]++;
+	pthread_mutex_unlock(&lock_statistics);
+}
+
+/**
+ * Publishes result of a poll cycle and wakes up all waiting threads, and processes sharing the device with the time
+ * window all pins have been sampled in
+ */
+void _mica_gpio_publish(uint64_t measured, uint64_t changed, uint64_t state, unsigned int missed, const struct mica_gpio_timestamp *window) {
+	pthread_mutex_lock(&lock_cycle);
+	struct cycle *cycle = &history[++cycles % HISTORY];
+	cycle->number = cycles;
+	cycle->measured = measured;
+	cycle->rising = changed & state;
+	cycle->falling = changed & ~state;
+	cycle->state = state;
+	pthread_cond_broadcast(&cond_cycle);
+	pthread_mutex_unlock(&lock_cycle);
+
+	if (broker == BROKER_OWNER) {
+		struct broker_cycle shared = { .number = cycles, .measured = measured, .rising = changed & state, .falling = changed & ~state,
+				.state = state, .missed = missed, .sampled = *window };
+		_mica_gpio_broker_publish(&shared);
+	}
+}
+
+void _mica_gpio_free_listener(struct listener *listener) {
+	free(listener->queue);
+	free(listener->stamps);
+	pthread_cond_destroy(&listener->cond);
+	pthread_mutex_destroy(&listener->lock);
+	free(listener);
+}
+
+/**
+ * Frees snapshot and the listener removed by replacing it
+ */
+void _mica_gpio_free_listeners(struct listeners *list) {
+	if (list->removed != NULL)
+		_mica_gpio_free_listener(list->removed);
+	free(list);
+}
+
+/**
+ * Enters the listeners (poll thread)
+ * @returns current snapshot, valid until _mica_gpio_leave
+ */
+struct listeners *_mica_gpio_enter() {
+	__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+	dispatching = 1;
+	return __atomic_load_n(&listeners, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Leaves the listeners (poll thread), freeing snapshots retired by listeners meanwhile
+ */
+void _mica_gpio_leave() {
+	dispatching = 0;
+	__atomic_add_fetch(&epoch, 1, __ATOMIC_RELEASE);
+	while (retired != NULL) {
+		struct listeners *list = retired;
+		retired = list->next;
+		_mica_gpio_free_listeners(list);
+	}
+}
+
+/**
+ * Frees snapshot replaced by a writer, once the poll thread no longer uses it. Called by a listener of the poll
+ * thread, the snapshot is freed on leaving the listeners.
+ */
+void _mica_gpio_retire(struct listeners *list) {
+	if (list == NULL)
+		return;
+	if (dispatching) {
+		list->next = retired;
+		retired = list;
+		return;
+	}
+	// the poll thread entered before the snapshot was replaced may still use it until it leaves
+	unsigned long long entered = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+	const struct timespec req = { .tv_nsec = 100000 };
+	while ((entered & 1) && __atomic_load_n(&epoch, __ATOMIC_ACQUIRE) == entered)
+		nanosleep(&req, NULL);
+	_mica_gpio_free_listeners(list);
+}
+
+/**
+ * Calls listener, a timed listener with the sample time of the pin
+ */
+void _mica_gpio_call_listener(struct listener *listener, int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp) {
+	if (listener->timed)
+		listener->timed(id, state, timestamp, listener->data);
+	else
+		listener->callback(id, state, listener->data);
+}
+
+/**
+ * Passes event to a listener, directly or through its queue. Events exceeding a full queue are dropped.
+ */
+void _mica_gpio_deliver(struct listener *listener, int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp) {
+	if (listener->queue == NULL) {
+		_mica_gpio_call_listener(listener, id, state, timestamp);
+		return;
+	}
+	unsigned int tail = listener->tail;
+	if (tail - __atomic_load_n(&listener->head, __ATOMIC_ACQUIRE) == listener->capacity) {
+		pthread_mutex_lock(&lock_statistics);
+		statistics.dropped_events++;
+		pthread_mutex_unlock(&lock_statistics);
+		return;
+	}
+	struct mica_gpio_event *event = &listener->queue[tail % listener->capacity];
+	event->id = id;
+	event->state = state;
+	event->cycle = cycles;
+	if (listener->stamps != NULL && timestamp != NULL)
+		listener->stamps[tail % listener->capacity] = *timestamp;
+	__atomic_store_n(&listener->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&listener->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&listener->lock);
+		pthread_cond_signal(&listener->cond);
+		pthread_mutex_unlock(&listener->lock);
+	}
+}
+
+/**
+ * Runs thread of a listener with queue, calling it for each queued event
+ */
+void *_mica_gpio_serve_listener(void *arg) {
+	struct listener *listener = arg;
+	serving = listener;
+	while (__atomic_load_n(&listener->enable, __ATOMIC_ACQUIRE)) {
+		unsigned int head = listener->head;
+		if (head == __atomic_load_n(&listener->tail, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&listener->lock);
+			__atomic_store_n(&listener->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (head == __atomic_load_n(&listener->tail, __ATOMIC_SEQ_CST) && listener->enable)
+				pthread_cond_wait(&listener->cond, &listener->lock);
+			__atomic_store_n(&listener->sleeping, 0, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&listener->lock);
+			continue;
+		}
+		struct mica_gpio_event event = listener->queue[head % listener->capacity];
+		struct mica_gpio_timestamp stamp = { };
+		if (listener->stamps != NULL)
+			stamp = listener->stamps[head % listener->capacity];
+		__atomic_store_n(&listener->head, head + 1, __ATOMIC_RELEASE);
+		_mica_gpio_call_listener(listener, event.id, event.state, event.id > 0 ? &stamp : NULL);
+	}
+	// removed by its own callback, nobody joins
+	if (serving == NULL)
+		_mica_gpio_free_listener(listener);
+	return NULL;
+}
+
+/**
+ * Calls the callback of the poll thread, a timed callback with the sample time of the pin
+ */
+void _mica_gpio_call(refer *ref, int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp) {
+	if (ref->timed)
+		ref->timed(id, state, timestamp, ref->data);
+	else if (ref->callback)
+		ref->callback(id, state, ref->data);
+}
+
+/**
+ * Calls callback and listeners for edges, bit n - 1 refers to pin n. Pin n has been sampled at sampled[(n - 1) / 2].
+ */
+void _mica_gpio_dispatch(refer *ref, uint64_t edges, uint64_t state, const struct mica_gpio_timestamp *sampled) {
+	PROBE2(dispatch, edges, state);
+	struct listeners *list = _mica_gpio_enter();
+	for (uint64_t pending = edges; pending;) {
+		int i = __builtin_ctzll(pending);
+		pending &= pending - 1;
+		_mica_gpio_call(ref, i + 1, state >> i & 1, &sampled[i / 2]);
+		for (int j = 0; list != NULL && j < list->count; j++)
+			_mica_gpio_deliver(list->items[j], i + 1, state >> i & 1, &sampled[i / 2]);
+	}
+	_mica_gpio_leave();
+	PROBE1(dispatch_done, edges);
+}
+
+/**
+ * Calls callback and listeners for a change of the device connection
+ */
+void _mica_gpio_notify(refer *ref, int id) {
+	_mica_gpio_call(ref, id, -1, NULL);
+	struct listeners *list = _mica_gpio_enter();
+	for (int j = 0; list != NULL && j < list->count; j++)
+		_mica_gpio_deliver(list->items[j], id, -1, NULL);
+	_mica_gpio_leave();
+}
+
+int _mica_gpio_watch(uint64_t mask, int count);
+
+/**
+ * @returns 1 if all pins are inputs read in mask, so every channel driving the interrupt line is polled
+ */
+int _mica_gpio_complete(uint64_t mask) {
+	uint64_t all = size < 64 ? (1ULL << size) - 1 : -1ULL;
+	if ((mask & all) != all)
+		return 0;
+	for (int i = 0; i < size; i++)
+		if (__atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED) == OUTPUT)
+			return 0;
+	return 1;
+}
+
+/**
+ * Compares events counted on the interrupt pin with falling edges seen by polling. As the counter is read just before
+ * the diagnosis banks, an edge may be seen one cycle before it is counted, such edges are credited to the next cycle.
+ * The counter sees edges of all channels, unless complete only the count is recorded, without missed edges.
+ * @returns number of edges missed by polling
+ */
+unsigned int _mica_gpio_reconcile(int events, uint64_t falling, int complete) {
+	if (events < 0 || !complete) {
+		credit = 0;
+		if (events > 0) {
+			pthread_mutex_lock(&lock_statistics);
+			statistics.interrupt_events += events;
+			pthread_mutex_unlock(&lock_statistics);
+		}
+		return 0;
+	}
+	unsigned int counted = events, seen = __builtin_popcountll(falling);
+	unsigned int missed = counted > seen + credit ? counted - seen - credit : 0;
+	credit = seen + credit > counted ? seen + credit - counted : 0;
+	if (credit > seen)
+		credit = seen;
+	pthread_mutex_lock(&lock_statistics);
+	statistics.interrupt_events += counted;
+	statistics.missed_edges += missed;
+	pthread_mutex_unlock(&lock_statistics);
+	return missed;
+}
+
+/**
+ * Executes commands of processes sharing the device
+ */
+void _mica_gpio_serve() {
+	struct broker_message message;
+	while (_mica_gpio_broker_receive(&message)) {
+		switch (message.command) {
+		case BROKER_DIRECTION:
+			mica_gpio_set_direction(message.id, message.value);
+			break;
+		case BROKER_ENABLE:
+			mica_gpio_set_enable(message.id, message.value);
+			break;
+		case BROKER_STATES:
+			mica_gpio_set_states(message.mask, message.value);
+			break;
+		case BROKER_WATCH:
+			if ((int) message.value > 0)
+				_mica_gpio_resume();
+			pthread_mutex_lock(&lock_cycle);
+			_mica_gpio_watch(message.mask, (int) message.value);
+			pthread_mutex_unlock(&lock_cycle);
+			break;
+		case BROKER_CONFIG: {
+			struct mica_gpio_config config = { .outputs = message.mask, .enabled = message.value };
+			mica_gpio_set_config(&config);
+			break;
+		}
+		}
+	}
+}
+
+/**
+ * Records time from losing the device until outputs have been restored
+ */
+void _mica_gpio_record_recovery() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&lock_statistics);
+	unsigned long long time = _mica_gpio_elapsed(&disconnected, &now);
+	statistics.reconnects++;
+	statistics.recover_time = time;
+	if (time > statistics.recover_time_max)
+		statistics.recover_time_max = time;
+	pthread_mutex_unlock(&lock_statistics);
 }
 
-void _mica_gpio_notify() {
-	uint64_t u = 1;
-	ssize_t n = write(event_in, &u, sizeof(uint64_t));
-	if (n != sizeof(uint64_t))
-		printf("Event writing error\n");
-	n = read(event_out, &u, sizeof(uint64_t));
-	if (n != sizeof(uint64_t))
-		printf("Event reading error");
+/**
+ * Touches the stack of the calling thread, so the poll loop does not fault in new stack pages
+ */
+void _mica_gpio_prefault() {
+	volatile unsigned char stack[PREFAULT];
+	for (int i = 0; i < PREFAULT; i += 256)
+		stack[i] = 0;
+	(void) stack[0];
+}
+
+/**
+ * Initializes poll thread attributes from real-time settings
+ */
+void _mica_gpio_init_attributes(pthread_attr_t *attr, const struct mica_gpio_realtime *settings) {
+	pthread_attr_init(attr);
+	if (settings->policy == SCHED_FIFO || settings->policy == SCHED_RR) {
+		struct sched_param param = { .sched_priority = settings->priority };
+		pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(attr, settings->policy);
+		pthread_attr_setschedparam(attr, &param);
+	}
+	if (settings->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(settings->cpu, &cpus);
+		pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+	}
 }
 
 /**
@@ -679,104 +2024,721 @@ void _mica_gpio_notify() {
 void *_mica_gpio_run(void *arg) {
 	refer *ref = arg;
 	void *data = ref->data;
-	ref->callback(0, -1, data);
-	const struct timespec req = { .tv_nsec = 5000000 };
-	struct timespec rem;
-	_mica_gpio_set_diagnosis();
-	while (enable) {
-		unsigned char tmp = bank;
-		_mica_gpio_poll(&bank);
-		if (waiting)
-			_mica_gpio_notify();
-		_mica_gpio_set_diagnosis();
-		for (short i = 0; i < MICA_GPIO_SIZE; i++) {
-			struct pin pin = pins[i];
-			if ((tmp & (1 << i)) != (bank & (1 << i))) {
-				if (pin.enabled == 1) {
-					ref->callback(i + 1, bank >> i & 1, data);
-				}
+	polling = 1;
+	// in real-time mode sleep until an absolute deadline, so processing time does not stretch the period
+	int absolute = ref->realtime.policy != SCHED_OTHER;
+	int lost = 0;
+	// pins with diagnosis current enabled before the last poll, and pins measured in the last cycle
+	uint64_t written, measured = 0;
+	_mica_gpio_prefault();
+	_mica_gpio_call(ref, MICA_GPIO_STARTED, -1, NULL);
+	struct timespec req, rem, next, last = { }, now;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	// position of the last poll cycle followed from the owner of the device
+	unsigned int seen = broker == BROKER_CLIENT ? _mica_gpio_broker_head() : 0;
+	// waits in stand-by
+	unsigned int waits = 0;
+	// sample time of each bank of two pins
+	struct mica_gpio_timestamp sampled[MICA_GPIO_SIZE / 2];
+	written = broker == BROKER_CLIENT ? 0 : _mica_gpio_set_diagnosis(0);
+	while (__atomic_load_n(&enable, __ATOMIC_RELAXED)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (last.tv_sec > 0 || last.tv_nsec > 0)
+			_mica_gpio_record_period(_mica_gpio_elapsed(&last, &now));
+		last = now;
+
+		if (broker == BROKER_OWNER)
+			_mica_gpio_serve();
+		if (broker != BROKER_CLIENT)
+			_mica_gpio_take_config();
+
+		if (broker == BROKER_CLIENT) {
+			// follow poll cycles published by the process owning the device
+			struct broker_cycle cycle;
+			int followed = 0;
+			while (_mica_gpio_broker_next(&seen, &cycle)) {
+				followed = 1;
+				__atomic_store_n(&bank, cycle.state, __ATOMIC_RELAXED);
+				_mica_gpio_publish(cycle.measured, cycle.rising | cycle.falling, cycle.state, cycle.missed, &cycle.sampled);
+				// sample times of single pins are not shared, each pin is reported within the cycle of the owner
+				for (int i = 0; i < MICA_GPIO_SIZE / 2; i++)
+					sampled[i] = cycle.sampled;
+				uint64_t edges = (cycle.rising & __atomic_load_n(&rising, __ATOMIC_RELAXED)) | (cycle.falling & __atomic_load_n(&falling, __ATOMIC_RELAXED));
+				_mica_gpio_dispatch(ref, edges & __atomic_load_n(&enabled, __ATOMIC_RELAXED), cycle.state, sampled);
+				if (cycle.missed)
+					_mica_gpio_notify(ref, MICA_GPIO_GLITCH);
+			}
+			if (!followed && !_mica_gpio_broker_alive()) {
+				// owner is gone, continue as owner
+				_mica_gpio_takeover();
+				measured = 0;
+			} else
+				_mica_gpio_follow();
+		} else if (!__atomic_load_n(&connected, __ATOMIC_RELAXED)) {
+			if (!lost) {
+				lost = 1;
+				measured = 0;
+				_mica_gpio_notify(ref, MICA_GPIO_DISCONNECTED);
+			}
+			int reconnected = _mica_gpio_transport_wait(VENDOR_ID, PRODUCT_ID, RETRY) ? _mica_gpio_reconnect() : -1;
+			if (reconnected >= 0) {
+				lost = 0;
+				written = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED);
+				// a device absent since initialization has not been recovered
+				if (reconnected == 0)
+					_mica_gpio_record_recovery();
+				_mica_gpio_notify(ref, MICA_GPIO_CONNECTED);
 			}
+			// do not catch up on periods missed while the device was lost
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		} else if (__atomic_load_n(&standby, __ATOMIC_RELAXED)) {
+			// no bus traffic until woken up, and periods spent in stand-by are not recorded
+			_mica_gpio_doze(&waits);
+			measured = 0;
+			written = __atomic_load_n(&dccr, __ATOMIC_RELAXED) | __atomic_load_n(&watched, __ATOMIC_RELAXED);
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			last.tv_sec = last.tv_nsec = 0;
+			if (broker == BROKER_OWNER)
+				_mica_gpio_share();
+			continue;
+		} else {
+			// the poll thread is the only writer of bank, readers load it atomically
+			uint64_t tmp = bank, level = bank;
+			unsigned int errors = 0;
+			int events;
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			uint64_t polled = _mica_gpio_poll(&level, &errors, &events, sampled) & written;
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			struct mica_gpio_timestamp window = _mica_gpio_window(&start, &end);
+			// banks not polled, e.g. after the device has been lost, keep their last level instead of reading LOW
+			level = (level & polled) | (tmp & ~polled);
+			__atomic_store_n(&bank, level, __ATOMIC_RELAXED);
+			_mica_gpio_check_errors(errors);
+			// only pins measured in this and the previous cycle can have changed
+			uint64_t changed = (tmp ^ level) & polled & measured;
+			unsigned int missed = _mica_gpio_reconcile(events, changed & ~level, _mica_gpio_complete(polled & measured));
+			_mica_gpio_publish(polled, changed, level, missed, &window);
+			// banks answered with transmission error stay measured, so their next read reports edges against the kept level
+			measured = polled | (measured & written);
+			written = _mica_gpio_set_diagnosis(written);
+			// select subscribed edges of enabled pins for the whole bank at once
+			changed &= __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+			_mica_gpio_dispatch(ref, (changed & level & __atomic_load_n(&rising, __ATOMIC_RELAXED)) | (changed & ~level & __atomic_load_n(&falling, __ATOMIC_RELAXED)),
+					level, sampled);
+			if (missed)
+				_mica_gpio_notify(ref, MICA_GPIO_GLITCH);
+			_mica_gpio_idle();
+		}
+		if (broker == BROKER_OWNER)
+			_mica_gpio_share();
+		if (absolute) {
+			_mica_gpio_advance(&next);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		} else {
+			long long duration = __atomic_load_n(&period, __ATOMIC_RELAXED);
+			req.tv_sec = duration / 1000000000;
+			req.tv_nsec = duration % 1000000000;
+			nanosleep(&req, &rem);
 		}
-		nanosleep(&req, &rem);
 	}
-	ref->callback(-1, -1, data);
+	_mica_gpio_call(ref, MICA_GPIO_STOPPED, -1, NULL);
 	free(ref);
 	pthread_exit(data);
 }
 
-void *mica_gpio_set_callback(mica_gpio_callback callback, void *data) {
+/**
+ * Starts the poll thread, lock_state must be held
+ */
+void _mica_gpio_start(mica_gpio_callback callback, mica_gpio_timed_callback timed, void *data) {
+	__atomic_store_n(&enable, 1, __ATOMIC_RELAXED);
+	refer *ref = malloc(sizeof(refer));
+	ref->callback = callback;
+	ref->timed = timed;
+	ref->data = data;
+	ref->realtime = realtime;
+	pthread_attr_t attr;
+	_mica_gpio_init_attributes(&attr, &ref->realtime);
+	if (pthread_create(&thread, &attr, _mica_gpio_run, (void *) ref) != 0) {
+		printf("WARNING: Failed to apply real-time settings (policy: %d, priority: %d, cpu: %d)\n", realtime.policy, realtime.priority, realtime.cpu);
+		ref->realtime.policy = SCHED_OTHER;
+		pthread_create(&thread, NULL, _mica_gpio_run, (void *) ref);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/**
+ * Replaces the callback of the poll thread, stopping it if neither callback is set and nothing else needs polling
+ * @returns data of the replaced callback
+ */
+void *_mica_gpio_replace(mica_gpio_callback callback, mica_gpio_timed_callback timed, void *data) {
 	void *result = NULL;
 	pthread_mutex_lock(&lock_state);
-	if (device == NULL) {
+	if (!__atomic_load_n(&connected, __ATOMIC_RELAXED)) {
 		pthread_mutex_unlock(&lock_state);
 		sleep(1);
 		pthread_mutex_lock(&lock_state);
 	}
 	if (thread != 0) {
-		enable = 0;
+		__atomic_store_n(&enable, 0, __ATOMIC_RELAXED);
+		pthread_cond_broadcast(&cond_standby);
 		pthread_join(thread, &result);
 		thread = 0;
 	}
-	if (thread == 0 && callback) {
-		enable = 1;
-		refer *ref = malloc(sizeof(refer));
-		ref->callback = callback;
-		ref->data = data;
-		pthread_create(&thread, NULL, _mica_gpio_run, (void *) ref);
+	if (thread == 0 && (callback || timed))
+		_mica_gpio_start(callback, timed, data);
+	else {
+		// abort waiting threads
+		pthread_mutex_lock(&lock_cycle);
+		stops++;
+		pthread_cond_broadcast(&cond_cycle);
+		pthread_mutex_unlock(&lock_cycle);
+		// keep polling for listeners, and following or publishing for processes sharing the device
+		if (broker != BROKER_NONE || __atomic_load_n(&listeners, __ATOMIC_RELAXED) != NULL)
+			_mica_gpio_start(NULL, NULL, NULL);
+	}
+	pthread_mutex_unlock(&lock_state);
+	return result;
+}
+
+void *mica_gpio_set_callback(mica_gpio_callback callback, void *data) {
+	return _mica_gpio_replace(callback, NULL, data);
+}
+
+/**
+ * Set callback like mica_gpio_set_callback, receiving the sample time of each edge. The time is estimated from the
+ * SPI frames reading and returning the diagnosis bank of the pin, instead of the time the callback runs.
+ * @returns data of the replaced callback
+ */
+void *mica_gpio_set_timed_callback(mica_gpio_timed_callback callback, void *data) {
+	return _mica_gpio_replace(NULL, callback, data);
+}
+
+/**
+ * Starts the poll thread without callback, if not running
+ */
+void _mica_gpio_acquire() {
+	pthread_mutex_lock(&lock_state);
+	if (thread == 0)
+		_mica_gpio_start(NULL, NULL, NULL);
+	pthread_mutex_unlock(&lock_state);
+}
+
+/**
+ * Add listener called for edges of enabled pins, subscribed by mica_gpio_set_edge, and for MICA_GPIO_DISCONNECTED
+ * and MICA_GPIO_CONNECTED, in addition to the callback. Listeners are added and removed while polling continues. The
+ * poll thread is started if not running.
+ * @param queue number of events queued for the listener, called by an own thread. Events exceeding a full queue are
+ * dropped. With 0 the listener is called by the poll thread and must return quickly.
+ * @returns
+ *     handle of the listener, for mica_gpio_remove_listener
+ *    -1 Invalid arguments or out of resources
+ */
+int _mica_gpio_add_listener(mica_gpio_callback callback, mica_gpio_timed_callback timed, void *data, unsigned int queue) {
+	if (callback == NULL && timed == NULL)
+		return -1;
+	struct listener *listener = calloc(1, sizeof(struct listener));
+	if (listener == NULL)
+		return -1;
+	listener->callback = callback;
+	listener->timed = timed;
+	listener->data = data;
+	listener->capacity = queue;
+	listener->enable = 1;
+	pthread_mutex_init(&listener->lock, NULL);
+	pthread_cond_init(&listener->cond, NULL);
+	if (queue > 0) {
+		listener->queue = calloc(queue, sizeof(struct mica_gpio_event));
+		if (timed != NULL)
+			listener->stamps = calloc(queue, sizeof(struct mica_gpio_timestamp));
+		if (listener->queue == NULL || (timed != NULL && listener->stamps == NULL) || pthread_create(&listener->thread, NULL, _mica_gpio_serve_listener, listener) != 0) {
+			_mica_gpio_free_listener(listener);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&lock_listeners);
+	struct listeners *previous = listeners;
+	int count = previous != NULL ? previous->count : 0;
+	struct listeners *list = malloc(sizeof(struct listeners) + (count + 1) * sizeof(struct listener *));
+	list->count = count + 1;
+	list->removed = NULL;
+	list->next = NULL;
+	if (count > 0)
+		memcpy(list->items, previous->items, count * sizeof(struct listener *));
+	list->items[count] = listener;
+	listener->handle = ++handles;
+	__atomic_store_n(&listeners, list, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&lock_listeners);
+
+	_mica_gpio_retire(previous);
+	_mica_gpio_acquire();
+	return listener->handle;
+}
+
+int mica_gpio_add_listener(mica_gpio_callback callback, void *data, unsigned int queue) {
+	return _mica_gpio_add_listener(callback, NULL, data, queue);
+}
+
+/**
+ * Add listener like mica_gpio_add_listener, receiving the sample time of each edge like the callback set by
+ * mica_gpio_set_timed_callback. Queued events keep their sample time.
+ * @returns
+ *     handle of the listener, for mica_gpio_remove_listener
+ *    -1 Invalid arguments or out of resources
+ */
+int mica_gpio_add_timed_listener(mica_gpio_timed_callback callback, void *data, unsigned int queue) {
+	return _mica_gpio_add_listener(NULL, callback, data, queue);
+}
+
+/**
+ * Remove listener, it is not called anymore once this returns, unless called from the listener itself. Events still
+ * queued are discarded.
+ * @returns
+ *     0 Listener removed
+ *    -1 Unknown handle
+ */
+int mica_gpio_remove_listener(int handle) {
+	pthread_mutex_lock(&lock_listeners);
+	struct listeners *previous = listeners;
+	int index = -1;
+	for (int i = 0; previous != NULL && i < previous->count; i++)
+		if (previous->items[i]->handle == handle)
+			index = i;
+	if (index < 0) {
+		pthread_mutex_unlock(&lock_listeners);
+		return -1;
+	}
+	struct listener *listener = previous->items[index];
+	struct listeners *list = NULL;
+	if (previous->count > 1) {
+		list = malloc(sizeof(struct listeners) + (previous->count - 1) * sizeof(struct listener *));
+		list->count = 0;
+		list->removed = NULL;
+		list->next = NULL;
+		for (int i = 0; i < previous->count; i++)
+			if (i != index)
+				list->items[list->count++] = previous->items[i];
+	}
+	__atomic_store_n(&listeners, list, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&lock_listeners);
+
+	if (listener->queue != NULL) {
+		pthread_mutex_lock(&listener->lock);
+		__atomic_store_n(&listener->enable, 0, __ATOMIC_RELEASE);
+		pthread_cond_signal(&listener->cond);
+		pthread_mutex_unlock(&listener->lock);
+		if (serving == listener) {
+			// called from the thread of the listener, it frees the listener on return
+			serving = NULL;
+			pthread_detach(listener->thread);
+			listener = NULL;
+		} else
+			pthread_join(listener->thread, NULL);
+	}
+	previous->removed = listener;
+	_mica_gpio_retire(previous);
+	return 0;
+}
+
+/**
+ * Adds (count = 1) or removes (count = -1) a waiting thread from the pins in mask, lock_cycle must be held.
+ * Watched pins are polled regardless of their enable state. The owner of a shared device polls the pins instead,
+ * the caller forwards the change to it after releasing lock_cycle, as the queue of the owner may be full.
+ * @returns 1 if the change has to be forwarded to the owner of the device
+ */
+int _mica_gpio_watch(uint64_t mask, int count) {
+	uint64_t result = 0;
+	for (int i = 0; i < size; i++) {
+		if ((mask >> i) & 1)
+			watchers[i] += count;
+		if (watchers[i] > 0)
+			result |= 1ULL << i;
+	}
+	__atomic_store_n(&watched, result, __ATOMIC_RELAXED);
+	// pins are polled by the owner of a shared device
+	return broker == BROKER_CLIENT;
+}
+
+/**
+ * Calculates deadline after timeout (ns) from now
+ */
+void _mica_gpio_deadline(struct timespec *deadline, long long timeout) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout / 1000000000;
+	deadline->tv_nsec += timeout % 1000000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		deadline->tv_nsec -= 1000000000;
+		deadline->tv_sec++;
+	}
+}
+
+/**
+ * Waits for the next poll cycle measuring the pin
+ * @returns state of the pin, 0 if the pin has not been measured within TIMEOUT
+ */
+char _mica_gpio_await(unsigned char id) {
+	uint64_t bit = 1ULL << id;
+	// a pin not read within TIMEOUT, e.g. answered with transmission errors only, reports its last level
+	int state = (__atomic_load_n(&bank, __ATOMIC_RELAXED) >> id) & 1, found = 0;
+	struct timespec deadline;
+
+	_mica_gpio_acquire();
+	_mica_gpio_resume();
+	_mica_gpio_deadline(&deadline, TIMEOUT * 1000000LL);
+
+	pthread_mutex_lock(&lock_cycle);
+	int forward = _mica_gpio_watch(bit, 1);
+	unsigned long long seen = cycles;
+	if (forward) {
+		pthread_mutex_unlock(&lock_cycle);
+		_mica_gpio_forward(BROKER_WATCH, 0, bit, 1);
+		pthread_mutex_lock(&lock_cycle);
+	}
+	while (!found) {
+		if (cycles - seen > HISTORY)
+			seen = cycles - HISTORY;
+		while (seen < cycles && !found) {
+			struct cycle *cycle = &history[++seen % HISTORY];
+			if (cycle->measured & bit) {
+				state = (cycle->state >> id) & 1;
+				found = 1;
+			}
+		}
+		if (!found && pthread_cond_timedwait(&cond_cycle, &lock_cycle, &deadline) == ETIMEDOUT)
+			break;
+	}
+	forward = _mica_gpio_watch(bit, -1);
+	pthread_mutex_unlock(&lock_cycle);
+	if (forward)
+		_mica_gpio_forward(BROKER_WATCH, 0, bit, -1);
+	return state;
+}
+
+/**
+ * Wait for an edge on any input pin selected by mask, bit n - 1 refers to pin n. Any number of threads may wait at
+ * once, they are woken by the poll thread after each cycle. The poll thread is started if not running.
+ * @param timeout nanoseconds to wait, -1 to wait forever
+ * @returns
+ *     1 Edge detected, event holds pin and new state
+ *     0 No edge within timeout
+ *    -1 Invalid arguments or poll thread stopped by mica_gpio_set_callback
+ */
+int mica_gpio_wait(uint64_t mask, enum MICA_GPIO_EDGE edge, long long timeout, struct mica_gpio_event *event) {
+	uint64_t inputs = 0;
+	for (int i = 0; i < size; i++)
+		if (((mask >> i) & 1) && __atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED) == INPUT)
+			inputs |= 1ULL << i;
+	if (inputs == 0 || edge < EDGE_RISING || edge > EDGE_BOTH || event == NULL)
+		return -1;
+
+	struct timespec deadline;
+	_mica_gpio_acquire();
+	_mica_gpio_resume();
+	_mica_gpio_deadline(&deadline, timeout > 0 ? timeout : 0);
+
+	int result = 0;
+	pthread_mutex_lock(&lock_cycle);
+	int forward = _mica_gpio_watch(inputs, 1);
+	unsigned long long seen = cycles, stopped = stops;
+	if (forward) {
+		pthread_mutex_unlock(&lock_cycle);
+		_mica_gpio_forward(BROKER_WATCH, 0, inputs, 1);
+		pthread_mutex_lock(&lock_cycle);
 	}
+	while (result == 0) {
+		if (cycles - seen > HISTORY)
+			seen = cycles - HISTORY;
+		while (seen < cycles && result == 0) {
+			struct cycle *cycle = &history[++seen % HISTORY];
+			uint64_t edges = ((edge & EDGE_RISING) ? cycle->rising : 0) | ((edge & EDGE_FALLING) ? cycle->falling : 0);
+			edges &= inputs;
+			if (edges) {
+				int i = __builtin_ctzll(edges);
+				event->id = i + 1;
+				event->state = (cycle->state >> i) & 1;
+				event->cycle = cycle->number;
+				result = 1;
+			}
+		}
+		if (result == 0) {
+			if (stops != stopped)
+				result = -1;
+			else if (timeout < 0)
+				pthread_cond_wait(&cond_cycle, &lock_cycle);
+			else if (pthread_cond_timedwait(&cond_cycle, &lock_cycle, &deadline) == ETIMEDOUT)
+				break;
+		}
+	}
+	forward = _mica_gpio_watch(inputs, -1);
+	pthread_mutex_unlock(&lock_cycle);
+	if (forward)
+		_mica_gpio_forward(BROKER_WATCH, 0, inputs, -1);
+	return result;
+}
+
+/**
+ * Set real-time settings of the poll thread. Scheduling and affinity take effect on the next call of mica_gpio_set_callback
+ * @returns
+ *     0 Settings accepted
+ *    -1 Invalid settings
+ *    -2 Locking memory failed
+ */
+int mica_gpio_set_realtime(const struct mica_gpio_realtime *settings) {
+	if (settings == NULL)
+		return -1;
+	switch (settings->policy) {
+	case SCHED_OTHER:
+	case SCHED_FIFO:
+	case SCHED_RR:
+		if (settings->priority < sched_get_priority_min(settings->policy) || settings->priority > sched_get_priority_max(settings->policy))
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+	if (settings->cpu >= CPU_SETSIZE)
+		return -1;
+
+	int result = 0;
+	pthread_mutex_lock(&lock_state);
+	if (settings->lock_memory && !realtime.lock_memory) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+			result = -2;
+	} else if (!settings->lock_memory && realtime.lock_memory)
+		munlockall();
+	if (result == 0)
+		realtime = *settings;
+	pthread_mutex_unlock(&lock_state);
+	return result;
+}
+
+void mica_gpio_get_realtime(struct mica_gpio_realtime *settings) {
+	pthread_mutex_lock(&lock_state);
+	*settings = realtime;
 	pthread_mutex_unlock(&lock_state);
+}
+
+void mica_gpio_get_statistics(struct mica_gpio_statistics *result) {
+	if (broker == BROKER_CLIENT) {
+		// statistics of the owner of the shared device
+		struct broker_state state;
+		_mica_gpio_broker_load(&state);
+		*result = state.statistics;
+	} else {
+		pthread_mutex_lock(&lock_statistics);
+		*result = statistics;
+		pthread_mutex_unlock(&lock_statistics);
+	}
+	if (result->cycles == 0)
+		result->period_min = 0;
+}
+
+void mica_gpio_reset_statistics() {
+	pthread_mutex_lock(&lock_statistics);
+	memset(&statistics, 0, sizeof(statistics));
+	statistics.period_min = -1ULL;
+	statistics.bit_rate = spi_settings.bit_rate;
+	pthread_mutex_unlock(&lock_statistics);
+}
+
+/**
+ * Set poll period, taking effect with the next cycle. Compare missed_edges with interrupt_events of
+ * mica_gpio_statistics to find a period short enough for the pulses at the inputs.
+ * @param value nanoseconds between poll cycles [100000-1000000000]
+ * @returns
+ *     0 Period accepted
+ *    -1 Period out of range
+ */
+int mica_gpio_set_period(long long value) {
+	if (value < PERIOD_MIN || value > PERIOD_MAX)
+		return -1;
+	__atomic_store_n(&period, value, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * @returns poll period (ns)
+ */
+long long mica_gpio_get_period() {
+	return __atomic_load_n(&period, __ATOMIC_RELAXED);
+}
+
+/**
+ * Set quiet time after which the switches are put in stand-by. The switches are quiet while no input is enabled or
+ * waited for and no output is HIGH. Polling stops in stand-by, the next API call using the switches, or an event
+ * counted on the interrupt pin, wakes them up and restores their registers. See wakeups and wake_time of
+ * mica_gpio_statistics.
+ * @param value nanoseconds of quiet before stand-by, 0 to keep the switches awake
+ * @returns
+ *     0 Time accepted
+ *    -1 Negative time
+ */
+int mica_gpio_set_standby(long long value) {
+	if (value < 0)
+		return -1;
+	_mica_gpio_lock_spi();
+	__atomic_store_n(&idle, value, __ATOMIC_RELAXED);
+	// quiet time starts now
+	_mica_gpio_wake();
+	pthread_mutex_unlock(&lock_spi);
+	return 0;
+}
+
+/**
+ * @returns quiet time before stand-by (ns), 0 if disabled
+ */
+long long mica_gpio_get_standby() {
+	return __atomic_load_n(&idle, __ATOMIC_RELAXED);
+}
+
+/**
+ * Calibrate the SPI bit rate. Bit rates are tried from the fastest, each without and with delays, until test
+ * patterns are echoed by all switches without transmission error. The result is stored in the MCP 2210 and used
+ * after the next start. Only available in the process owning the device.
+ * @returns
+ *     bit rate applied (bit/s)
+ *    -1 No reliable setting found, or device not available
+ */
+int mica_gpio_calibrate() {
+	int result = -1;
+	_mica_gpio_lock_spi();
+	if (broker != BROKER_CLIENT && connected)
+		result = _mica_gpio_calibrate();
+	pthread_mutex_unlock(&lock_spi);
 	return result;
 }
 
+/**
+ * @returns number of pins of all SPI switches detected on initialization, MICA_GPIO_CHANNELS per switch
+ */
+int mica_gpio_get_count() {
+	return size;
+}
+
 enum MICA_GPIO_DIRECTION mica_gpio_get_direction(unsigned char id) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
-		struct pin pin = pins[id - 1];
-		return pin.direction;
+	if (id > 0 && id <= size) {
+		return __atomic_load_n(&pins[id - 1].direction, __ATOMIC_RELAXED);
 	}
 	return -1;
 }
 
 void mica_gpio_set_direction(unsigned char id, enum MICA_GPIO_DIRECTION direction) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
+	if (id > 0 && id <= size) {
 		if (direction == INPUT || direction == OUTPUT) {
-			pins[id - 1].direction = direction;
+			pthread_rwlock_rdlock(&lock_shared);
+			__atomic_store_n(&pins[id - 1].direction, direction, __ATOMIC_RELAXED);
+			if (broker == BROKER_CLIENT)
+				_mica_gpio_forward(BROKER_DIRECTION, id, 0, direction);
+			pthread_rwlock_unlock(&lock_shared);
 		}
 	}
 }
 
 enum MICA_GPIO_STATE mica_gpio_get_state(unsigned char id) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
-		struct pin pin = pins[id - 1];
+	if (id > 0 && id <= size) {
+		enum MICA_GPIO_DIRECTION direction = __atomic_load_n(&pins[id - 1].direction, __ATOMIC_RELAXED);
 		unsigned char idd=id-1;
-		switch (pin.direction) {
+		switch (direction) {
 		case OUTPUT:
-			//return (icr & (3 << (0 * 2))) == 3;
-			return (icr & (3 << (idd * 2))) == 3 << idd*2;
+			if (broker == BROKER_CLIENT)
+				return (mica_gpio_get_states() >> idd) & 1;
+			return ((__atomic_load_n(&icr[idd / MICA_GPIO_CHANNELS], __ATOMIC_RELAXED) >> (idd % MICA_GPIO_CHANNELS * 2)) & 3) == 3;
 		case INPUT:
-			return _mica_gpio_await(pin, id - 1);
+			return _mica_gpio_await(id - 1);
 		}
 	}
 	return -1;
 }
 
 void mica_gpio_set_state(unsigned char id, enum MICA_GPIO_STATE state) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
-		struct pin pin = pins[id - 1];
-		if (pin.direction == OUTPUT) {
+	if (id > 0 && id <= size) {
+		enum MICA_GPIO_DIRECTION direction = __atomic_load_n(&pins[id - 1].direction, __ATOMIC_RELAXED);
+		if (direction == OUTPUT) {
 			if (state == LOW || state == HIGH) {
-				pthread_mutex_lock(&lock_spi);
-				if (device != NULL)
+				if (broker == BROKER_CLIENT)
+					_mica_gpio_forward(BROKER_STATES, id, 1ULL << (id - 1), state == HIGH ? -1ULL : 0);
+				else {
+					_mica_gpio_lock_spi();
+					_mica_gpio_wake();
 					_mica_gpio_set_state(id - 1, state);
-				pthread_mutex_unlock(&lock_spi);
+					pthread_mutex_unlock(&lock_spi);
+				}
 			}
 		}
 	}
 }
 
+/**
+ * Get state of all pins at once, bit n - 1 holds the state of pin n. Inputs report the last sampled level of
+ * enabled pins, without waiting for the next poll cycle.
+ */
+uint64_t mica_gpio_get_states() {
+	if (broker == BROKER_CLIENT) {
+		// state published by the owner of the shared device
+		struct broker_state state;
+		_mica_gpio_broker_load(&state);
+		return state.states;
+	}
+	uint64_t result = 0;
+	for (int i = 0; i < size; i++) {
+		switch (__atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED)) {
+		case OUTPUT:
+			if (((__atomic_load_n(&icr[i / MICA_GPIO_CHANNELS], __ATOMIC_RELAXED) >> (i % MICA_GPIO_CHANNELS * 2)) & 3) == 3)
+				result |= 1ULL << i;
+			break;
+		case INPUT:
+			if (__atomic_load_n(&pins[i].enabled, __ATOMIC_RELAXED) == 1 && ((__atomic_load_n(&bank, __ATOMIC_RELAXED) >> i) & 1))
+				result |= 1ULL << i;
+			break;
+		}
+	}
+	return result;
+}
+
+/**
+ * Set state of all output pins selected by mask at once, bit n - 1 refers to pin n. Changed address banks of all
+ * switches are written in one SPI batch.
+ */
+void mica_gpio_set_states(uint64_t mask, uint64_t states) {
+	if (broker == BROKER_CLIENT) {
+		_mica_gpio_forward(BROKER_STATES, 0, mask, states);
+		return;
+	}
+	_mica_gpio_lock_spi();
+	_mica_gpio_wake();
+	unsigned short tmp[SWITCHES];
+	memcpy(tmp, icr, sizeof(tmp));
+	for (int i = 0; i < size; i++) {
+		if (((mask >> i) & 1) && __atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED) == OUTPUT) {
+			int chip = i / MICA_GPIO_CHANNELS, channel = i % MICA_GPIO_CHANNELS;
+			tmp[chip] = (tmp[chip] & ~(3 << (channel * 2))) + ((((states >> i) & 1) * 3) << (channel * 2));
+		}
+	}
+
+	unsigned char chips[SWITCHES * 4], cmd[SWITCHES * 4], response[SWITCHES * 4];
+	int count = 0;
+	for (int i = 0; i < switches * 4; i++) {
+		int chip = i / 4, address = i % 4;
+		if (((tmp[chip] ^ icr[chip]) >> (address * 4)) & 0xf) {
+			chips[count] = chip;
+			cmd[count++] = WRITE + (address << 4) + ((tmp[chip] >> (address * 4)) & 0xf);
+		}
+	}
+	if (count > 0) {
+		int result = _mica_gpio_transfer_to_spi_batch(chips, cmd, response, count);
+		// remember state on success, or replay it once a lost device is back
+		if (result == 1 || !connected)
+			for (int s = 0; s < SWITCHES; s++)
+				__atomic_store_n(&icr[s], tmp[s], __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lock_spi);
+}
+
 unsigned char mica_gpio_get_enable(unsigned char id) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
-		struct pin pin = pins[id - 1];
-		if (pin.direction == INPUT) {
+	if (id > 0 && id <= size) {
+		enum MICA_GPIO_DIRECTION direction = __atomic_load_n(&pins[id - 1].direction, __ATOMIC_RELAXED);
+		if (direction == INPUT) {
 			return _mica_gpio_get_enable(id - 1);
 		}
 	}
@@ -784,9 +2746,111 @@ unsigned char mica_gpio_get_enable(unsigned char id) {
 }
 
 void mica_gpio_set_enable(unsigned char id, unsigned char enable) {
-	if (id > 0 && id <= MICA_GPIO_SIZE) {
-		struct pin pin = pins[id - 1];
-		if (pin.direction == INPUT)
-			_mica_gpio_set_enable(id - 1, pins[id - 1].enabled = enable);
+	if (id > 0 && id <= size) {
+		enum MICA_GPIO_DIRECTION direction = __atomic_load_n(&pins[id - 1].direction, __ATOMIC_RELAXED);
+		if (direction == INPUT) {
+			if (enable == 1)
+				_mica_gpio_resume();
+			pthread_rwlock_rdlock(&lock_shared);
+			__atomic_store_n(&pins[id - 1].enabled, enable, __ATOMIC_RELAXED);
+			_mica_gpio_set_enable(id - 1, enable);
+			if (enable == 1)
+				__atomic_or_fetch(&enabled, 1ULL << (id - 1), __ATOMIC_RELAXED);
+			else
+				__atomic_and_fetch(&enabled, ~(1ULL << (id - 1)), __ATOMIC_RELAXED);
+			if (broker == BROKER_CLIENT)
+				_mica_gpio_forward(BROKER_ENABLE, id, 0, enable);
+			pthread_rwlock_unlock(&lock_shared);
+		}
+	}
+}
+
+/**
+ * Get direction and enable of all pins, including a configuration not yet applied by the poll thread
+ */
+void mica_gpio_get_config(struct mica_gpio_config *config) {
+	pthread_mutex_lock(&lock_config);
+	struct mica_gpio_config *next = __atomic_load_n(&pending, __ATOMIC_ACQUIRE);
+	if (next != NULL)
+		*config = *next;
+	else {
+		config->outputs = 0;
+		for (int i = 0; i < size; i++)
+			if (__atomic_load_n(&pins[i].direction, __ATOMIC_RELAXED) == OUTPUT)
+				config->outputs |= 1ULL << i;
+		config->enabled = __atomic_load_n(&enabled, __ATOMIC_RELAXED) & ~config->outputs;
+	}
+	pthread_mutex_unlock(&lock_config);
+}
+
+/**
+ * Set direction and enable of all pins at once. The configuration is published to the poll thread as a whole and
+ * applied at the start of its next cycle, its diagnosis current enable registers are written in one SPI batch by
+ * that cycle. The poll loop never sees a configuration applied in part. Returns once the configuration has been
+ * applied, or replaced by a later one. Without poll thread it is applied at once, called by the poll thread itself
+ * it is applied with the next cycle.
+ * @returns
+ *     0 Configuration applied
+ *    -1 Configuration refers to pins beyond mica_gpio_get_count, or enables outputs
+ */
+int mica_gpio_set_config(const struct mica_gpio_config *config) {
+	uint64_t all = size < 64 ? (1ULL << size) - 1 : -1ULL;
+	if (((config->outputs | config->enabled) & ~all) || (config->outputs & config->enabled))
+		return -1;
+	// wake the switches, the poll thread does not cycle in stand-by
+	_mica_gpio_resume();
+	if (broker == BROKER_CLIENT) {
+		pthread_rwlock_rdlock(&lock_shared);
+		_mica_gpio_apply(config);
+		_mica_gpio_forward(BROKER_CONFIG, 0, config->outputs, config->enabled);
+		pthread_rwlock_unlock(&lock_shared);
+		return 0;
+	}
+
+	pthread_mutex_lock(&lock_config);
+	struct mica_gpio_config *next = &configs[filling];
+	// the poll thread may still copy the buffer published before the last one
+	const struct timespec req = { .tv_nsec = 100000 };
+	while (__atomic_load_n(&taking, __ATOMIC_SEQ_CST) == next)
+		nanosleep(&req, NULL);
+	*next = *config;
+	__atomic_store_n(&pending, next, __ATOMIC_SEQ_CST);
+	filling ^= 1;
+	pthread_mutex_unlock(&lock_config);
+	if (polling)
+		return 0;
+
+	while (__atomic_load_n(&enable, __ATOMIC_RELAXED) && __atomic_load_n(&pending, __ATOMIC_ACQUIRE) == next)
+		nanosleep(&req, NULL);
+	// no poll thread, unless it has started and taken the configuration meanwhile
+	pthread_mutex_lock(&lock_config);
+	struct mica_gpio_config *expected = next;
+	if (__atomic_compare_exchange_n(&pending, &expected, NULL, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		_mica_gpio_apply(next);
+	pthread_mutex_unlock(&lock_config);
+	return 0;
+}
+
+enum MICA_GPIO_EDGE mica_gpio_get_edge(unsigned char id) {
+	if (id > 0 && id <= size)
+		return ((__atomic_load_n(&rising, __ATOMIC_RELAXED) >> (id - 1)) & 1) * EDGE_RISING
+				+ ((__atomic_load_n(&falling, __ATOMIC_RELAXED) >> (id - 1)) & 1) * EDGE_FALLING;
+	return -1;
+}
+
+/**
+ * Subscribe pin to rising, falling or both edges. Edges not subscribed never reach the callback.
+ */
+void mica_gpio_set_edge(unsigned char id, enum MICA_GPIO_EDGE edge) {
+	if (id > 0 && id <= size && edge >= EDGE_NONE && edge <= EDGE_BOTH) {
+		uint64_t bit = 1ULL << (id - 1);
+		if (edge & EDGE_RISING)
+			__atomic_or_fetch(&rising, bit, __ATOMIC_RELAXED);
+		else
+			__atomic_and_fetch(&rising, ~bit, __ATOMIC_RELAXED);
+		if (edge & EDGE_FALLING)
+			__atomic_or_fetch(&falling, bit, __ATOMIC_RELAXED);
+		else
+			__atomic_and_fetch(&falling, ~bit, __ATOMIC_RELAXED);
 	}
 }
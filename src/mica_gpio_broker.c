@@ -0,0 +1,377 @@
+/*
+ * mica_gpio_broker.c
+ *
+ * Shared memory broker. The owner holds an exclusive flock on the segment as long as it lives, clients detect a
+ * lost owner by acquiring that lock. State is published with a seqlock, poll cycles in a ring read by any number of
+ * clients, each slot guarded by its own sequence. Commands are queued in a bounded multi-producer ring, each slot
+ * carrying the position it may be written or read at.
+ *
+ * A process may die in the middle of a write. Readers never wait longer than STALL for a sequence to become even, a
+ * new owner repairs the sequences left odd, and the owner skips a command slot claimed but not written for STALL.
+ */
+
+#define _GNU_SOURCE
+
+#include "mica_gpio_broker.h"
+
+#include <fcntl.h>
+#include <grp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAGIC   0x4d494341 // segment initialized
+#define ATTACH  5000       // wait for the owner to become ready (ms)
+#define STALL   1000       // writer of a slot presumed dead (ms)
+#define SPINS   1000       // busy reads of a sequence before sleeping
+
+/** Slot of the event ring */
+struct event {
+	/** Sequence of the slot, odd while written */
+	unsigned int sequence;
+	/** Position of the cycle in the ring */
+	unsigned int position;
+	struct broker_cycle cycle;
+};
+
+/** Slot of the command queue */
+struct command {
+	/** Position the slot may be written at, or position + 1 once written */
+	unsigned int sequence;
+	struct broker_message message;
+};
+
+/** Layout of the shared memory segment */
+struct segment {
+	unsigned int magic;
+	unsigned int size;
+	/** Process id of the owner */
+	pid_t owner;
+	/** Published state is valid */
+	unsigned int ready;
+
+	/** Sequence of state, odd while written */
+	unsigned int sequence;
+	struct broker_state state;
+
+	/** Number of published cycles */
+	unsigned int head;
+	struct event events[BROKER_EVENTS];
+
+	/** Positions of the next command to queue and to take */
+	unsigned int enqueue;
+	unsigned int dequeue;
+	struct command commands[BROKER_COMMANDS];
+};
+
+static struct segment *segment = NULL;
+static int fd = -1;
+
+/** Position after the last command queued by this process */
+static unsigned int sent = 0;
+
+/** A claimed command slot has not been written since, at position stalled */
+static int pending = 0;
+static unsigned int stalled;
+static struct timespec since;
+
+/**
+ * @returns milliseconds elapsed since start
+ */
+static long long _mica_gpio_broker_elapsed(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000LL + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Wait while the writer of a sequence is busy
+ * @returns sequence, odd if the writer did not finish within STALL
+ */
+static unsigned int _mica_gpio_broker_settle(const unsigned int *sequence) {
+	const struct timespec req = { .tv_nsec = 100000 };
+	struct timespec start;
+	unsigned int value;
+	for (int i = 0; (value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1; i++) {
+		if (i < SPINS)
+			continue;
+		if (i == SPINS)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		else if (_mica_gpio_broker_elapsed(&start) >= STALL)
+			break;
+		nanosleep(&req, NULL);
+	}
+	return value;
+}
+
+/**
+ * Mark data guarded by a sequence as being written. The exchange acquires the sequence, so the writes of the data
+ * that follow are not visible before it.
+ */
+static void _mica_gpio_broker_begin(unsigned int *sequence, unsigned int odd) {
+	__atomic_exchange_n(sequence, odd, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Read a sequence again after copying the data it guards. Adding zero releases the sequence, so the reads of the
+ * data complete before it.
+ * @returns sequence, differs from the one read before if the data has been written meanwhile
+ */
+static unsigned int _mica_gpio_broker_check(unsigned int *sequence) {
+	return __atomic_fetch_add(sequence, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Initialize the segment, or keep it if it was left by a previous owner
+ */
+static void _mica_gpio_broker_init() {
+	if (segment->magic != MAGIC || segment->size != sizeof(struct segment)) {
+		memset(segment, 0, sizeof(struct segment));
+		for (int i = 0; i < BROKER_COMMANDS; i++)
+			segment->commands[i].sequence = i;
+		segment->size = sizeof(struct segment);
+		__atomic_store_n(&segment->magic, MAGIC, __ATOMIC_RELEASE);
+	}
+	// a previous owner died while writing, the torn state is replaced by the next share
+	if (segment->sequence & 1)
+		__atomic_store_n(&segment->sequence, segment->sequence + 1, __ATOMIC_RELEASE);
+	// the torn cycle is not read, its position was written before the cycle and head was not advanced
+	for (int i = 0; i < BROKER_EVENTS; i++)
+		if (segment->events[i].sequence & 1)
+			__atomic_store_n(&segment->events[i].sequence, segment->events[i].sequence + 1, __ATOMIC_RELEASE);
+	pending = 0;
+	segment->owner = getpid();
+}
+
+/**
+ * Restrict the segment to the user of the owner, or to the members of BROKER_GROUP if the owner belongs to it
+ * @returns
+ *     0 Segment only accessible by the user or the group
+ *    -1 Segment accessible by other users
+ */
+static int _mica_gpio_broker_protect(enum broker_role role) {
+	struct group *group = getgrnam(BROKER_GROUP);
+	if (role == BROKER_OWNER) {
+		if (group != NULL && fchown(fd, -1, group->gr_gid) == 0)
+			fchmod(fd, 0660);
+		else
+			fchmod(fd, 0600);
+	}
+	struct stat stat;
+	if (fstat(fd, &stat) < 0 || (stat.st_mode & S_IRWXO))
+		return -1;
+	if (stat.st_uid == geteuid())
+		return 0;
+	// left by another user, who may only have given it to the group
+	return group != NULL && stat.st_gid == group->gr_gid ? 0 : -1;
+}
+
+enum broker_role _mica_gpio_broker_open() {
+	// sharing is opt-in, as any process attached can drive the outputs
+	const char *env = getenv("MICA_GPIO_BROKER");
+	if (env == NULL || strcmp(env, "1") != 0)
+		return BROKER_NONE;
+
+	fd = shm_open(BROKER_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		printf("WARNING: Failed to open shared memory %s, using the device exclusively\n", BROKER_NAME);
+		return BROKER_NONE;
+	}
+
+	enum broker_role role = flock(fd, LOCK_EX | LOCK_NB) == 0 ? BROKER_OWNER : BROKER_CLIENT;
+	if (_mica_gpio_broker_protect(role) < 0) {
+		printf("WARNING: Shared memory %s accessible by other users, using the device exclusively\n", BROKER_NAME);
+		close(fd);
+		fd = -1;
+		return BROKER_NONE;
+	}
+	if (role == BROKER_OWNER && ftruncate(fd, sizeof(struct segment)) < 0) {
+		close(fd);
+		fd = -1;
+		return BROKER_NONE;
+	}
+
+	// a new segment is sized by the owner just after taking the lock
+	struct stat stat;
+	const struct timespec req = { .tv_nsec = 1000000 };
+	for (int i = 0; role == BROKER_CLIENT && i < ATTACH && fstat(fd, &stat) == 0 && stat.st_size < sizeof(struct segment); i++)
+		nanosleep(&req, NULL);
+	if (fstat(fd, &stat) == 0 && stat.st_size >= sizeof(struct segment))
+		segment = mmap(NULL, sizeof(struct segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment == NULL || segment == MAP_FAILED) {
+		segment = NULL;
+		close(fd);
+		fd = -1;
+		return BROKER_NONE;
+	}
+
+	if (role == BROKER_OWNER) {
+		_mica_gpio_broker_init();
+		__atomic_store_n(&segment->ready, 0, __ATOMIC_RELEASE);
+	} else {
+		// wait for the owner to publish its state
+		for (int i = 0; i < ATTACH && !__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE); i++)
+			nanosleep(&req, NULL);
+		if (!__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE)) {
+			printf("WARNING: Owner of shared memory %s not ready, using the device exclusively\n", BROKER_NAME);
+			_mica_gpio_broker_close();
+			return BROKER_NONE;
+		}
+	}
+	return role;
+}
+
+void _mica_gpio_broker_close() {
+	if (segment != NULL)
+		munmap(segment, sizeof(struct segment));
+	segment = NULL;
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+void _mica_gpio_broker_ready() {
+	__atomic_store_n(&segment->ready, 1, __ATOMIC_RELEASE);
+}
+
+int _mica_gpio_broker_alive() {
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+		return 1;
+	_mica_gpio_broker_init();
+	return 0;
+}
+
+void _mica_gpio_broker_publish(const struct broker_cycle *cycle) {
+	unsigned int position = segment->head;
+	struct event *slot = &segment->events[position % BROKER_EVENTS];
+	unsigned int sequence = slot->sequence;
+	_mica_gpio_broker_begin(&slot->sequence, sequence + 1);
+	slot->position = position;
+	slot->cycle = *cycle;
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&segment->head, position + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int _mica_gpio_broker_head() {
+	return __atomic_load_n(&segment->head, __ATOMIC_ACQUIRE);
+}
+
+int _mica_gpio_broker_next(unsigned int *seen, struct broker_cycle *cycle) {
+	for (;;) {
+		unsigned int head = __atomic_load_n(&segment->head, __ATOMIC_ACQUIRE);
+		if (head == *seen)
+			return 0;
+		if (head - *seen > BROKER_EVENTS)
+			*seen = head - BROKER_EVENTS;
+
+		struct event *slot = &segment->events[*seen % BROKER_EVENTS];
+		unsigned int sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			// slot overwritten right now, or by an owner which died, the cycle is lost
+			(*seen)++;
+			continue;
+		}
+		unsigned int position = slot->position;
+		*cycle = slot->cycle;
+		if (_mica_gpio_broker_check(&slot->sequence) != sequence)
+			continue;
+		if (position != *seen) {
+			// slot overwritten meanwhile, skip to the oldest cycle still available
+			*seen = head - BROKER_EVENTS;
+			continue;
+		}
+		(*seen)++;
+		return 1;
+	}
+}
+
+void _mica_gpio_broker_store(const struct broker_state *state) {
+	unsigned int sequence = segment->sequence;
+	_mica_gpio_broker_begin(&segment->sequence, sequence + 1);
+	segment->state = *state;
+	segment->state.served = segment->dequeue;
+	__atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int _mica_gpio_broker_load(struct broker_state *state) {
+	unsigned int sequence;
+	do {
+		sequence = _mica_gpio_broker_settle(&segment->sequence);
+		*state = segment->state;
+		if (sequence & 1)
+			return -1;
+	} while (_mica_gpio_broker_check(&segment->sequence) != sequence);
+	return 0;
+}
+
+int _mica_gpio_broker_served(const struct broker_state *state) {
+	return (int) (__atomic_load_n(&sent, __ATOMIC_ACQUIRE) - state->served) <= 0;
+}
+
+int _mica_gpio_broker_send(const struct broker_message *message) {
+	unsigned int position = __atomic_load_n(&segment->enqueue, __ATOMIC_RELAXED);
+	for (;;) {
+		struct command *slot = &segment->commands[position % BROKER_COMMANDS];
+		int diff = (int) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&segment->enqueue, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				slot->message = *message;
+				__atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+				// commands of several threads are queued concurrently, keep the latest position
+				unsigned int last = __atomic_load_n(&sent, __ATOMIC_RELAXED);
+				while ((int) (position + 1 - last) > 0
+						&& !__atomic_compare_exchange_n(&sent, &last, position + 1, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+					;
+				return 0;
+			}
+		} else if (diff < 0)
+			return -1;
+		else
+			position = __atomic_load_n(&segment->enqueue, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Track a command slot claimed but not written yet
+ * @returns 1 if the slot at position has been pending for STALL
+ */
+static int _mica_gpio_broker_stalled(unsigned int position) {
+	if (!pending || stalled != position) {
+		pending = 1;
+		stalled = position;
+		clock_gettime(CLOCK_MONOTONIC, &since);
+		return 0;
+	}
+	return _mica_gpio_broker_elapsed(&since) >= STALL;
+}
+
+int _mica_gpio_broker_receive(struct broker_message *message) {
+	unsigned int position = segment->dequeue;
+	struct command *slot = &segment->commands[position % BROKER_COMMANDS];
+	unsigned int sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if (sequence == position - BROKER_COMMANDS + 1) {
+		// written after its slot was skipped, the command is dropped and the slot freed again
+		__atomic_compare_exchange_n(&slot->sequence, &sequence, position, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (sequence != position + 1) {
+		if (sequence != position || __atomic_load_n(&segment->enqueue, __ATOMIC_RELAXED) == position || !_mica_gpio_broker_stalled(position))
+			return 0;
+		// claimed by a client which died before writing its command, skip the slot
+		if (!__atomic_compare_exchange_n(&slot->sequence, &sequence, position + BROKER_COMMANDS, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return 0;
+		printf("WARNING: Command of a client of the shared device not written within %d ms, skipped\n", STALL);
+		fflush(stdout);
+		segment->dequeue = position + 1;
+		return _mica_gpio_broker_receive(message);
+	}
+	*message = slot->message;
+	__atomic_store_n(&slot->sequence, position + BROKER_COMMANDS, __ATOMIC_RELEASE);
+	segment->dequeue = position + 1;
+	return 1;
+}
@@ -0,0 +1,162 @@
+/*
+ * mica_gpio_broker.h
+ *
+ * Shared memory broker, letting several processes use one MCP 2210. The first process loading the library owns the
+ * device and publishes poll cycles and state in a POSIX shared memory segment. All other processes attach as clients,
+ * read the published state without system calls and send their commands through a queue to the owner.
+ *
+ * The broker is opt-in, each process sharing the device sets the environment variable MICA_GPIO_BROKER=1. Anyone able
+ * to write the segment can drive the outputs, so it is only accessible by the user of the owner, or by the members of
+ * BROKER_GROUP if that group exists and the owner belongs to it. Processes of other users are added to that group to
+ * share the device, e.g. addgroup --system mica-gpio && adduser <user> mica-gpio.
+ */
+
+#ifndef MICA_GPIO_BROKER_H
+#define MICA_GPIO_BROKER_H
+
+#include "../include/mica_gpio.h"
+
+#define BROKER_NAME     "/mica_gpio" // name of the shared memory segment
+#define BROKER_GROUP    "mica-gpio"  // group of users sharing the device, if it exists
+#define BROKER_EVENTS   256          // poll cycles kept in the event ring (power of two)
+#define BROKER_COMMANDS 64           // commands queued by clients (power of two)
+
+/** Role of the process */
+enum broker_role {
+	BROKER_NONE,  // broker disabled or not available, the process uses the device exclusively
+	BROKER_OWNER, // process owns the device and publishes its state
+	BROKER_CLIENT // process follows the owner
+};
+
+/** Commands sent by clients to the owner */
+enum broker_command {
+	BROKER_DIRECTION, // set direction of pin id to value
+	BROKER_ENABLE,    // set enable of pin id to value
+	BROKER_STATES,    // set state of output pins selected by mask to value
+	BROKER_WATCH,     // add value (1 or -1) waiting threads to pins selected by mask
+	BROKER_CONFIG     // set outputs to mask and enabled inputs to value
+};
+
+/** Command sent by a client */
+struct broker_message {
+	enum broker_command command;
+	int id;
+	uint64_t mask;
+	uint64_t value;
+};
+
+/** Poll cycle published by the owner */
+struct broker_cycle {
+	unsigned long long number;
+	uint64_t measured;
+	uint64_t rising;
+	uint64_t falling;
+	uint64_t state;
+	/** Edges counted on the interrupt pin but missed by polling */
+	unsigned int missed;
+	/** Sample time of all pins read in the cycle */
+	struct mica_gpio_timestamp sampled;
+};
+
+/** State published by the owner */
+struct broker_state {
+	/** Number of pins */
+	int size;
+	/** State of all pins, see mica_gpio_get_states */
+	uint64_t states;
+	/** Pins configured as output */
+	uint64_t outputs;
+	/** Pins configured as input */
+	uint64_t inputs;
+	/** Diagnosis current enable of all pins */
+	uint64_t dccr;
+	/** Enabled input pins */
+	uint64_t enabled;
+	/** Position of the next command the owner takes, set by the broker */
+	unsigned int served;
+	/** Input control register of each switch */
+	unsigned short icr[MICA_GPIO_SIZE / MICA_GPIO_CHANNELS];
+	/** Active chip select value of each switch */
+	unsigned short chip_select[MICA_GPIO_SIZE / MICA_GPIO_CHANNELS];
+	struct mica_gpio_statistics statistics;
+};
+
+/**
+ * Open the shared memory segment and take the role of owner, if no other process holds it. The broker is enabled by
+ * setting the environment variable MICA_GPIO_BROKER=1. A segment accessible by other users is not used.
+ * @returns role of the process
+ */
+enum broker_role _mica_gpio_broker_open(void);
+
+/**
+ * Unmap the shared memory segment, the segment itself is kept for the next owner
+ */
+void _mica_gpio_broker_close(void);
+
+/**
+ * Mark the published state as valid, clients waiting on attach continue
+ */
+void _mica_gpio_broker_ready(void);
+
+/**
+ * Check whether the owner is still alive. If it is gone, the calling client takes over the role of owner.
+ * @returns
+ *     1 Owner alive
+ *     0 Owner gone, the calling process is the owner now
+ */
+int _mica_gpio_broker_alive(void);
+
+/**
+ * Publish a poll cycle to the event ring (owner)
+ */
+void _mica_gpio_broker_publish(const struct broker_cycle *cycle);
+
+/**
+ * Read the next poll cycle after position seen from the event ring (client). Cycles overwritten before or while
+ * being read are skipped.
+ * @returns
+ *     1 Cycle read, seen advanced
+ *     0 No new cycle
+ */
+int _mica_gpio_broker_next(unsigned int *seen, struct broker_cycle *cycle);
+
+/**
+ * @returns position of the last published poll cycle
+ */
+unsigned int _mica_gpio_broker_head(void);
+
+/**
+ * Publish state (owner)
+ */
+void _mica_gpio_broker_store(const struct broker_state *state);
+
+/**
+ * Read consistent copy of the published state (client)
+ * @returns
+ *     0 State read
+ *    -1 Owner stalled while publishing, state holds a possibly torn copy
+ */
+int _mica_gpio_broker_load(struct broker_state *state);
+
+/**
+ * @returns 1 if the owner had taken all commands queued by this process when publishing state, 0 otherwise
+ */
+int _mica_gpio_broker_served(const struct broker_state *state);
+
+/**
+ * Queue command for the owner (client)
+ * @returns
+ *     0 Command queued
+ *    -1 Queue full
+ */
+int _mica_gpio_broker_send(const struct broker_message *message);
+
+/**
+ * Take next queued command (owner)
+ * @returns
+ *     1 Command taken
+ *     0 Queue empty
+ */
+int _mica_gpio_broker_receive(struct broker_message *message);
+
+#endif /* MICA_GPIO_BROKER_H */
@@ -0,0 +1,77 @@
+/*
+ * mica_gpio_hidapi.c
+ *
+ * Synchronous hidapi backend of the MCP 2210 transport
+ */
+
+#define _GNU_SOURCE
+
+#include "mica_gpio_transport.h"
+
+#include <hidapi/hidapi.h>
+#include <stdio.h>
+#include <time.h>
+
+static hid_device *device = NULL;
+
+int _mica_gpio_transport_open(unsigned short vendor_id, unsigned short product_id) {
+	hid_init();
+
+	// Open the device using the VID, PID and optionally the Serial number.
+	device = hid_open(vendor_id, product_id, 0);
+	if (device == NULL)
+		return -1;
+
+	// Set the hid_read() function to be blocking.
+	hid_set_nonblocking(device, 0);
+	return 0;
+}
+
+void _mica_gpio_transport_close() {
+	if (device != NULL)
+		hid_close(device);
+	device = NULL;
+}
+
+void _mica_gpio_transport_exit() {
+	/* Free static HIDAPI objects. */
+	hid_exit();
+}
+
+int _mica_gpio_transport_wait(unsigned short vendor_id, unsigned short product_id, int timeout) {
+	struct hid_device_info *devs = hid_enumerate(vendor_id, product_id);
+	if (devs != NULL) {
+		hid_free_enumeration(devs);
+		return 1;
+	}
+	const struct timespec req = { .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000 };
+	nanosleep(&req, NULL);
+	return 0;
+}
+
+int _mica_gpio_transport_write(const unsigned char *data, size_t length) {
+	return hid_write(device, data, length);
+}
+
+int _mica_gpio_transport_read(unsigned char *data, size_t length, int timeout) {
+	return hid_read_timeout(device, data, length, timeout);
+}
+
+void _mica_gpio_list() {
+	struct hid_device_info *devs, *cur_dev;
+
+	devs = hid_enumerate(0x0, 0x0);
+	cur_dev = devs;
+	while (cur_dev) {
+		printf("mica_gpio Device Found\n  type: %04hx %04hx\n  path: %s\n  serial_number: %ls", cur_dev->vendor_id, cur_dev->product_id, cur_dev->path,
+				cur_dev->serial_number);
+		printf("\n");
+		printf("  Manufacturer: %ls\n", cur_dev->manufacturer_string);
+		printf("  Product:      %ls\n", cur_dev->product_string);
+		printf("  Release:      %hx\n", cur_dev->release_number);
+		printf("  Interface:    %d\n", cur_dev->interface_number);
+		printf("\n");
+		cur_dev = cur_dev->next;
+	}
+	hid_free_enumeration(devs);
+}
@@ -0,0 +1,301 @@
+/*
+ * mica_gpio_libusb.c
+ *
+ * Asynchronous libusb backend of the MCP 2210 transport. Up to IN_FLIGHT OUT
+ * reports are queued on the interrupt endpoint, while IN_FLIGHT IN transfers
+ * are kept submitted and collect the responses in order. Attach and detach of
+ * the device are tracked with a hotplug callback, where supported.
+ */
+
+#define _GNU_SOURCE
+
+#include "mica_gpio_transport.h"
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define INTERFACE    0
+#define ENDPOINT_IN  0x81
+#define ENDPOINT_OUT 0x01
+
+#define REPORT_SIZE 64
+#define QUEUE_SIZE  (2 * IN_FLIGHT) // received reports not read yet
+#define TIMEOUT     1000            // OUT transfer timeout (ms)
+
+static libusb_context *context = NULL;
+static libusb_device_handle *handle = NULL;
+
+/** Transfers of the open device, each owning its buffer, so a transfer orphaned on close never writes to a reused one */
+static struct libusb_transfer *out[IN_FLIGHT], *in[IN_FLIGHT];
+/** Transfers in flight, until their callback has run */
+static int out_busy[IN_FLIGHT], in_busy[IN_FLIGHT];
+static int out_next = 0;
+
+static unsigned char queue[QUEUE_SIZE][REPORT_SIZE];
+static int queue_head = 0, queue_count = 0;
+
+static int failed = 0;
+static int closing = 0;
+
+static libusb_hotplug_callback_handle hotplug;
+static int hotplug_registered = 0;
+static int present = 0;
+
+/**
+ * Frees transfer orphaned by closing the device before its cancellation completed
+ * @returns 1 if the transfer has been orphaned
+ */
+static int _mica_gpio_orphaned(struct libusb_transfer *transfer) {
+	if (transfer->user_data != NULL)
+		return 0;
+	libusb_free_transfer(transfer);
+	return 1;
+}
+
+static void LIBUSB_CALL _mica_gpio_out_done(struct libusb_transfer *transfer) {
+	int *busy = transfer->user_data;
+	if (_mica_gpio_orphaned(transfer))
+		return;
+	*busy = 0;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		failed = 1;
+}
+
+static void LIBUSB_CALL _mica_gpio_in_done(struct libusb_transfer *transfer) {
+	int *busy = transfer->user_data;
+	if (_mica_gpio_orphaned(transfer))
+		return;
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if (transfer->actual_length > 0) {
+			if (queue_count < QUEUE_SIZE) {
+				unsigned char *report = queue[(queue_head + queue_count) % QUEUE_SIZE];
+				memset(report, 0, REPORT_SIZE);
+				memcpy(report, transfer->buffer, transfer->actual_length);
+				queue_count++;
+			} else
+				// response lost, the reader would be out of sync
+				failed = 1;
+		}
+		// keep the transfer queued for the next report
+		if (!closing && libusb_submit_transfer(transfer) == 0)
+			return;
+	} else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		failed = 1;
+	*busy = 0;
+}
+
+static int LIBUSB_CALL _mica_gpio_hotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) {
+	present = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+	return 0;
+}
+
+/**
+ * Handles pending transfer events for at most timeout milliseconds
+ */
+static int _mica_gpio_handle_events(int timeout) {
+	struct timeval tv = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 };
+	return libusb_handle_events_timeout_completed(context, &tv, NULL) < 0 ? -1 : 0;
+}
+
+/**
+ * Initializes the libusb context, kept until _mica_gpio_transport_exit
+ */
+static int _mica_gpio_init_context() {
+	if (context == NULL && libusb_init(&context) < 0) {
+		context = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int _mica_gpio_transport_open(unsigned short vendor_id, unsigned short product_id) {
+	if (_mica_gpio_init_context() < 0)
+		return -1;
+	handle = libusb_open_device_with_vid_pid(context, vendor_id, product_id);
+	if (handle == NULL)
+		return -1;
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	if (libusb_claim_interface(handle, INTERFACE) < 0) {
+		libusb_close(handle);
+		handle = NULL;
+		return -1;
+	}
+
+	failed = 0;
+	closing = 0;
+	out_next = 0;
+	queue_head = 0;
+	queue_count = 0;
+	for (int i = 0; i < IN_FLIGHT; i++) {
+		out[i] = libusb_alloc_transfer(0);
+		out[i]->buffer = malloc(REPORT_SIZE);
+		out[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		out_busy[i] = 0;
+		in[i] = libusb_alloc_transfer(0);
+		libusb_fill_interrupt_transfer(in[i], handle, ENDPOINT_IN, malloc(REPORT_SIZE), REPORT_SIZE, _mica_gpio_in_done, &in_busy[i], 0);
+		in[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		in_busy[i] = libusb_submit_transfer(in[i]) == 0;
+	}
+	return 0;
+}
+
+void _mica_gpio_transport_close() {
+	if (handle != NULL) {
+		closing = 1;
+		for (int i = 0; i < IN_FLIGHT; i++) {
+			libusb_cancel_transfer(in[i]);
+			if (out_busy[i])
+				libusb_cancel_transfer(out[i]);
+		}
+		// wait for cancellations, bounded in case the device is gone
+		for (int retries = 10; retries > 0; retries--) {
+			int busy = 0;
+			for (int i = 0; i < IN_FLIGHT; i++)
+				busy += in_busy[i] + out_busy[i];
+			if (busy == 0 || _mica_gpio_handle_events(100) < 0)
+				break;
+		}
+		// a transfer still in flight must not be freed, it is left to its callback in case it ever completes and
+		// frees its buffer with it
+		for (int i = 0; i < IN_FLIGHT; i++) {
+			if (in_busy[i])
+				in[i]->user_data = NULL;
+			else
+				libusb_free_transfer(in[i]);
+			if (out_busy[i])
+				out[i]->user_data = NULL;
+			else
+				libusb_free_transfer(out[i]);
+			in_busy[i] = out_busy[i] = 0;
+		}
+		libusb_release_interface(handle, INTERFACE);
+		libusb_close(handle);
+		handle = NULL;
+	}
+}
+
+void _mica_gpio_transport_exit() {
+	if (context != NULL) {
+		if (hotplug_registered)
+			libusb_hotplug_deregister_callback(context, hotplug);
+		hotplug_registered = 0;
+		libusb_exit(context);
+	}
+	context = NULL;
+}
+
+int _mica_gpio_transport_wait(unsigned short vendor_id, unsigned short product_id, int timeout) {
+	if (_mica_gpio_init_context() < 0)
+		return 0;
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		// reports already attached devices on registration
+		if (!hotplug_registered
+				&& libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+						LIBUSB_HOTPLUG_ENUMERATE, vendor_id, product_id, LIBUSB_HOTPLUG_MATCH_ANY, _mica_gpio_hotplug, NULL, &hotplug) == 0)
+			hotplug_registered = 1;
+		if (!present)
+			_mica_gpio_handle_events(timeout);
+		else
+			_mica_gpio_handle_events(0);
+		return present;
+	}
+
+	// no hotplug support, look for the device
+	libusb_device **devs;
+	int found = 0;
+	ssize_t count = libusb_get_device_list(context, &devs);
+	for (ssize_t i = 0; i < count && !found; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(devs[i], &desc) == 0)
+			found = desc.idVendor == vendor_id && desc.idProduct == product_id;
+	}
+	if (count >= 0)
+		libusb_free_device_list(devs, 1);
+	if (!found) {
+		const struct timespec req = { .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000 };
+		nanosleep(&req, NULL);
+	}
+	return found;
+}
+
+int _mica_gpio_transport_write(const unsigned char *data, size_t length) {
+	if (handle == NULL || length < 1)
+		return -1;
+
+	// wait for the oldest OUT transfer, if all are in flight
+	while (out_busy[out_next] && !failed)
+		if (_mica_gpio_handle_events(TIMEOUT) < 0)
+			return -1;
+	if (failed)
+		return -1;
+
+	// strip report number
+	size_t size = length - 1 < REPORT_SIZE ? length - 1 : REPORT_SIZE;
+	unsigned char *buffer = out[out_next]->buffer;
+	memset(buffer, 0, REPORT_SIZE);
+	memcpy(buffer, data + 1, size);
+
+	libusb_fill_interrupt_transfer(out[out_next], handle, ENDPOINT_OUT, buffer, REPORT_SIZE, _mica_gpio_out_done, &out_busy[out_next], TIMEOUT);
+	if (libusb_submit_transfer(out[out_next]) < 0) {
+		failed = 1;
+		return -1;
+	}
+	out_busy[out_next] = 1;
+	out_next = (out_next + 1) % IN_FLIGHT;
+	return length;
+}
+
+int _mica_gpio_transport_read(unsigned char *data, size_t length, int timeout) {
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int polled = 0;
+	while (queue_count == 0) {
+		if (handle == NULL || failed)
+			return -1;
+		int wait = 100;
+		if (timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait = timeout - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+			if (wait <= 0) {
+				if (polled)
+					return 0;
+				wait = 0;
+			}
+		}
+		if (_mica_gpio_handle_events(wait) < 0)
+			return -1;
+		polled = 1;
+	}
+
+	size_t size = length < REPORT_SIZE ? length : REPORT_SIZE;
+	memcpy(data, queue[queue_head], size);
+	queue_head = (queue_head + 1) % QUEUE_SIZE;
+	queue_count--;
+	return size;
+}
+
+void _mica_gpio_list() {
+	libusb_context *ctx;
+	libusb_device **devs;
+
+	if (libusb_init(&ctx) < 0)
+		return;
+	ssize_t count = libusb_get_device_list(ctx, &devs);
+	for (ssize_t i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(devs[i], &desc) == 0) {
+			printf("mica_gpio Device Found\n  type: %04hx %04hx\n", desc.idVendor, desc.idProduct);
+			printf("  Bus:          %d\n", libusb_get_bus_number(devs[i]));
+			printf("  Address:      %d\n", libusb_get_device_address(devs[i]));
+			printf("  Release:      %hx\n", desc.bcdDevice);
+			printf("\n");
+		}
+	}
+	if (count >= 0)
+		libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+}
@@ -0,0 +1,42 @@
+/*
+ * mica_gpio_probes.h
+ *
+ * Static tracepoints (USDT) of provider mica_gpio, compiled in by defining MICA_GPIO_PROBES (make PROBES=1, needs
+ * sys/sdt.h of systemtap-sdt-dev). Each probe is a single nop until a tracer like perf or bpftrace attaches to it,
+ * without MICA_GPIO_PROBES the probes are removed completely.
+ *
+ * Probes and arguments:
+ *   hid_write(command)                       report written to the transport
+ *   hid_write_done(result)
+ *   hid_read(timeout)                        report read from the transport
+ *   hid_read_done(result, command)
+ *   register_send(chip_select, frame)        SPI frame sent to a switch
+ *   register_done(chip_select, frame, answer)
+ *   poll(diagnosis)                          diagnosis banks of all switches read
+ *   poll_done(polled, errors)
+ *   dispatch(edges, state)                   callback and listeners called for edges
+ *   dispatch_done(edges)
+ *   jni_call(id, state)                      Java listener called
+ *   jni_call_done(id)
+ */
+
+#ifndef MICA_GPIO_PROBES_H
+#define MICA_GPIO_PROBES_H
+
+#ifdef MICA_GPIO_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)       DTRACE_PROBE1(mica_gpio, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(mica_gpio, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mica_gpio, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a)       do { } while (0)
+#define PROBE2(name, a, b)    do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+
+#endif
+
+#endif /* MICA_GPIO_PROBES_H */
@@ -0,0 +1,516 @@
+/*
+ * mica_gpio_python.c
+ *
+ * CPython extension module. Edges are queued by the poll thread without taking
+ * the GIL and handed to Python in timestamped batches. Each event source is a
+ * listener of its own, any number of them may be open at once.
+ */
+
+#define _GNU_SOURCE
+#define PY_SSIZE_T_CLEAN
+
+#include <Python.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/mica_gpio.h"
+
+#define QUEUE_SIZE 1024
+
+/** Queued edge, or change of the device connection with a negative id and state -1 */
+struct event {
+	/** CLOCK_MONOTONIC (ns), the sample time of an edge or the time of the notification */
+	uint64_t time;
+	int id;
+	int state;
+};
+
+/** Event source, receives the callback of the poll thread */
+typedef struct {
+	PyObject_HEAD
+	struct event *queue;
+	size_t size;
+	size_t head;
+	size_t count;
+	/** Events dropped since the queue was full */
+	unsigned long long dropped;
+	/** Readable while events are queued, -1 if not opened */
+	int fd;
+	/** Handle of the listener, 0 once closed */
+	int listener;
+	/** Lock and condition have been initialized, by events_init */
+	int initialized;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} events;
+
+static void call(int id, enum MICA_GPIO_STATE state, const struct mica_gpio_timestamp *timestamp, void *data) {
+	events *self = data;
+	uint64_t time;
+
+	// edges carry the time they have been sampled, notifications the time they are received
+	if (timestamp != NULL)
+		time = timestamp->time;
+	else {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+	pthread_mutex_lock(&self->lock);
+	if (self->count < self->size) {
+		struct event *event = &self->queue[(self->head + self->count) % self->size];
+		event->time = time;
+		event->id = id;
+		event->state = state;
+		if (self->count++ == 0) {
+			uint64_t u = 1;
+			if (write(self->fd, &u, sizeof(u)) < 0) {
+				// counter about to overflow, readable anyway - the event is queued, not dropped
+			}
+			pthread_cond_broadcast(&self->cond);
+		}
+	} else
+		self->dropped++;
+	pthread_mutex_unlock(&self->lock);
+}
+
+static void events_stop(events *self) {
+	if (self->listener > 0) {
+		mica_gpio_remove_listener(self->listener);
+		self->listener = 0;
+		// wake up readers
+		pthread_mutex_lock(&self->lock);
+		pthread_cond_broadcast(&self->cond);
+		pthread_mutex_unlock(&self->lock);
+	}
+}
+
+static int events_init(events *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = { "size", NULL };
+	Py_ssize_t size = QUEUE_SIZE;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n", keywords, &size))
+		return -1;
+	if (size <= 0) {
+		PyErr_SetString(PyExc_ValueError, "size must be positive");
+		return -1;
+	}
+	if (self->initialized) {
+		PyErr_SetString(PyExc_RuntimeError, "already initialized");
+		return -1;
+	}
+	// each resource is released by events_dealloc once set up, even if a later one fails
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	self->fd = -1;
+	self->initialized = 1;
+
+	self->queue = PyMem_RawCalloc(size, sizeof(struct event));
+	if (self->queue == NULL) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	self->size = size;
+	self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (self->fd < 0) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
+
+	int listener;
+	Py_BEGIN_ALLOW_THREADS
+	listener = mica_gpio_add_timed_listener(call, self, 0);
+	Py_END_ALLOW_THREADS
+	if (listener < 0) {
+		PyErr_SetString(PyExc_RuntimeError, "failed to add listener");
+		return -1;
+	}
+	self->listener = listener;
+	return 0;
+}
+
+static void events_dealloc(events *self) {
+	if (self->initialized) {
+		Py_BEGIN_ALLOW_THREADS
+		events_stop(self);
+		Py_END_ALLOW_THREADS
+		if (self->fd >= 0)
+			close(self->fd);
+		pthread_cond_destroy(&self->cond);
+		pthread_mutex_destroy(&self->lock);
+	}
+	PyMem_RawFree(self->queue);
+	Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/**
+ * Takes all queued events, waits for at most timeout seconds for the first one
+ * @returns list of (time, id, state) tuples, None if the source has been closed
+ */
+static PyObject *events_take(events *self, double timeout) {
+	struct event *batch;
+	size_t count = 0;
+
+	batch = PyMem_RawMalloc(self->size * sizeof(struct event));
+	if (batch == NULL)
+		return PyErr_NoMemory();
+
+	Py_BEGIN_ALLOW_THREADS
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout > 0) {
+		deadline.tv_sec += (time_t) timeout;
+		deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+	}
+
+	pthread_mutex_lock(&self->lock);
+	while (self->count == 0 && self->listener > 0 && timeout != 0) {
+		if (timeout < 0)
+			pthread_cond_wait(&self->cond, &self->lock);
+		else if (pthread_cond_timedwait(&self->cond, &self->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	while (self->count > 0) {
+		batch[count++] = self->queue[self->head];
+		self->head = (self->head + 1) % self->size;
+		self->count--;
+	}
+	uint64_t u;
+	if (read(self->fd, &u, sizeof(u)) < 0) {
+		// not signaled
+	}
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+
+	if (count == 0 && self->listener == 0) {
+		PyMem_RawFree(batch);
+		Py_RETURN_NONE;
+	}
+
+	PyObject *result = PyList_New(count);
+	for (size_t i = 0; result != NULL && i < count; i++) {
+		PyObject *item = Py_BuildValue("(Kii)", (unsigned long long) batch[i].time, batch[i].id, batch[i].state);
+		if (item == NULL) {
+			Py_CLEAR(result);
+			break;
+		}
+		PyList_SET_ITEM(result, i, item);
+	}
+	PyMem_RawFree(batch);
+	return result;
+}
+
+static PyObject *events_read(events *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = { "timeout", NULL };
+	PyObject *timeout = Py_None;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", keywords, &timeout))
+		return NULL;
+	double value = -1;
+	if (timeout != Py_None) {
+		value = PyFloat_AsDouble(timeout);
+		if (value == -1 && PyErr_Occurred())
+			return NULL;
+		if (value < 0)
+			value = 0;
+	}
+	PyObject *result = events_take(self, value);
+	if (result == Py_None) {
+		Py_DECREF(result);
+		PyErr_SetString(PyExc_ValueError, "event source closed");
+		return NULL;
+	}
+	return result;
+}
+
+static PyObject *events_fileno(events *self, PyObject *unused) {
+	return PyLong_FromLong(self->fd);
+}
+
+static PyObject *events_close(events *self, PyObject *unused) {
+	Py_BEGIN_ALLOW_THREADS
+	events_stop(self);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject *events_get_dropped(events *self, void *closure) {
+	pthread_mutex_lock(&self->lock);
+	unsigned long long dropped = self->dropped;
+	pthread_mutex_unlock(&self->lock);
+	return PyLong_FromUnsignedLongLong(dropped);
+}
+
+static PyObject *events_iter(PyObject *self) {
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *events_next(events *self) {
+	PyObject *result = events_take(self, -1);
+	if (result == Py_None) {
+		// StopIteration
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+static PyObject *events_enter(PyObject *self, PyObject *unused) {
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *events_exit(events *self, PyObject *args) {
+	return events_close(self, NULL);
+}
+
+static PyMethodDef events_methods[] = { //
+		{ "read", (PyCFunction) events_read, METH_VARARGS | METH_KEYWORDS,
+				"read(timeout=None) -> list of (time, id, state)\n\nWaits for edges, returns all queued edges with their CLOCK_MONOTONIC sample time (ns).\n"
+				"DISCONNECTED, CONNECTED and GLITCH are queued as id with state -1" }, //
+		{ "fileno", (PyCFunction) events_fileno, METH_NOARGS, "File descriptor readable while edges are queued, for use with select()" }, //
+		{ "close", (PyCFunction) events_close, METH_NOARGS, "Stops delivery of edges" }, //
+		{ "__enter__", (PyCFunction) events_enter, METH_NOARGS, NULL }, //
+		{ "__exit__", (PyCFunction) events_exit, METH_VARARGS, NULL }, //
+		{ NULL } };
+
+static PyGetSetDef events_getset[] = { //
+		{ "dropped", (getter) events_get_dropped, NULL, "Number of edges dropped due to a full queue", NULL }, //
+		{ NULL } };
+
+static PyTypeObject events_type = { //
+		PyVarObject_HEAD_INIT(NULL, 0) //
+		.tp_name = "mica_gpio.Events", //
+		.tp_doc = "Events(size=1024)\n\nSource of timestamped edges, iterating yields batches", //
+		.tp_basicsize = sizeof(events), //
+		.tp_flags = Py_TPFLAGS_DEFAULT, //
+		.tp_new = PyType_GenericNew, //
+		.tp_init = (initproc) events_init, //
+		.tp_dealloc = (destructor) events_dealloc, //
+		.tp_iter = events_iter, //
+		.tp_iternext = (iternextfunc) events_next, //
+		.tp_methods = events_methods, //
+		.tp_getset = events_getset };
+
+static PyObject *get_direction(PyObject *module, PyObject *args) {
+	unsigned char id;
+	if (!PyArg_ParseTuple(args, "b", &id))
+		return NULL;
+	return PyLong_FromLong(mica_gpio_get_direction(id));
+}
+
+static PyObject *set_direction(PyObject *module, PyObject *args) {
+	unsigned char id;
+	int direction;
+	if (!PyArg_ParseTuple(args, "bi", &id, &direction))
+		return NULL;
+	mica_gpio_set_direction(id, direction);
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_enable(PyObject *module, PyObject *args) {
+	unsigned char id;
+	if (!PyArg_ParseTuple(args, "b", &id))
+		return NULL;
+	return PyBool_FromLong(mica_gpio_get_enable(id));
+}
+
+static PyObject *set_enable(PyObject *module, PyObject *args) {
+	unsigned char id;
+	int enable;
+	if (!PyArg_ParseTuple(args, "bp", &id, &enable))
+		return NULL;
+	mica_gpio_set_enable(id, enable);
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_edge(PyObject *module, PyObject *args) {
+	unsigned char id;
+	if (!PyArg_ParseTuple(args, "b", &id))
+		return NULL;
+	return PyLong_FromLong(mica_gpio_get_edge(id));
+}
+
+static PyObject *set_edge(PyObject *module, PyObject *args) {
+	unsigned char id;
+	int edge;
+	if (!PyArg_ParseTuple(args, "bi", &id, &edge))
+		return NULL;
+	mica_gpio_set_edge(id, edge);
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_state(PyObject *module, PyObject *args) {
+	unsigned char id;
+	enum MICA_GPIO_STATE state;
+	if (!PyArg_ParseTuple(args, "b", &id))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	state = mica_gpio_get_state(id);
+	Py_END_ALLOW_THREADS
+	return PyLong_FromLong(state);
+}
+
+static PyObject *set_state(PyObject *module, PyObject *args) {
+	unsigned char id;
+	int state;
+	if (!PyArg_ParseTuple(args, "bi", &id, &state))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	mica_gpio_set_state(id, state);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_count(PyObject *module, PyObject *unused) {
+	return PyLong_FromLong(mica_gpio_get_count());
+}
+
+static PyObject *calibrate(PyObject *module, PyObject *unused) {
+	int result;
+	Py_BEGIN_ALLOW_THREADS
+	result = mica_gpio_calibrate();
+	Py_END_ALLOW_THREADS
+	return PyLong_FromLong(result);
+}
+
+static PyObject *get_period(PyObject *module, PyObject *unused) {
+	return PyLong_FromLongLong(mica_gpio_get_period());
+}
+
+static PyObject *set_period(PyObject *module, PyObject *args) {
+	long long period;
+	if (!PyArg_ParseTuple(args, "L", &period))
+		return NULL;
+	if (mica_gpio_set_period(period) < 0) {
+		PyErr_SetString(PyExc_ValueError, "period out of range");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_standby(PyObject *module, PyObject *unused) {
+	return PyLong_FromLongLong(mica_gpio_get_standby());
+}
+
+static PyObject *set_standby(PyObject *module, PyObject *args) {
+	long long idle;
+	int result;
+	if (!PyArg_ParseTuple(args, "L", &idle))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	result = mica_gpio_set_standby(idle);
+	Py_END_ALLOW_THREADS
+	if (result < 0) {
+		PyErr_SetString(PyExc_ValueError, "idle time must not be negative");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_config(PyObject *module, PyObject *unused) {
+	struct mica_gpio_config config;
+	mica_gpio_get_config(&config);
+	return Py_BuildValue("(KK)", (unsigned long long) config.outputs, (unsigned long long) config.enabled);
+}
+
+static PyObject *set_config(PyObject *module, PyObject *args) {
+	unsigned long long outputs, enabled;
+	int result;
+	if (!PyArg_ParseTuple(args, "KK", &outputs, &enabled))
+		return NULL;
+	struct mica_gpio_config config = { .outputs = outputs, .enabled = enabled };
+	Py_BEGIN_ALLOW_THREADS
+	result = mica_gpio_set_config(&config);
+	Py_END_ALLOW_THREADS
+	if (result < 0) {
+		PyErr_SetString(PyExc_ValueError, "invalid configuration");
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *get_states(PyObject *module, PyObject *unused) {
+	return PyLong_FromUnsignedLongLong(mica_gpio_get_states());
+}
+
+static PyObject *set_states(PyObject *module, PyObject *args) {
+	unsigned long long mask, states;
+	if (!PyArg_ParseTuple(args, "KK", &mask, &states))
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	mica_gpio_set_states(mask, states);
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef methods[] = { //
+		{ "get_count", get_count, METH_NOARGS, "get_count() -> int\n\nNumber of pins of all detected switches" }, //
+		{ "calibrate", calibrate, METH_NOARGS, "calibrate() -> int\n\nCalibrate the SPI bit rate, returns the bit rate applied or -1" }, //
+		{ "get_period", get_period, METH_NOARGS, "get_period() -> int\n\nPoll period (ns)" }, //
+		{ "set_period", set_period, METH_VARARGS, "set_period(period)\n\nSet poll period (ns), taking effect with the next cycle" }, //
+		{ "get_standby", get_standby, METH_NOARGS, "get_standby() -> int\n\nQuiet time before stand-by (ns), 0 if disabled" }, //
+		{ "set_standby", set_standby, METH_VARARGS, "set_standby(idle)\n\nPut the switches in stand-by after idle ns without enabled inputs or HIGH outputs, 0 to disable" }, //
+		{ "get_direction", get_direction, METH_VARARGS, "get_direction(id) -> INPUT or OUTPUT" }, //
+		{ "set_direction", set_direction, METH_VARARGS, "set_direction(id, direction)" }, //
+		{ "get_enable", get_enable, METH_VARARGS, "get_enable(id) -> bool" }, //
+		{ "set_enable", set_enable, METH_VARARGS, "set_enable(id, enable)" }, //
+		{ "get_config", get_config, METH_NOARGS, "get_config() -> (outputs, enabled)\n\nDirection and enable of all pins, bit n - 1 refers to pin n" }, //
+		{ "set_config", set_config, METH_VARARGS, "set_config(outputs, enabled)\n\nSet direction and enable of all pins at once, applied with the next poll cycle" }, //
+		{ "get_edge", get_edge, METH_VARARGS, "get_edge(id) -> EDGE_NONE, EDGE_RISING, EDGE_FALLING or EDGE_BOTH" }, //
+		{ "set_edge", set_edge, METH_VARARGS, "set_edge(id, edge)\n\nSubscribe pin to edges, others are not queued" }, //
+		{ "get_state", get_state, METH_VARARGS, "get_state(id) -> LOW or HIGH" }, //
+		{ "set_state", set_state, METH_VARARGS, "set_state(id, state)" }, //
+		{ "get_states", get_states, METH_NOARGS, "get_states() -> int\n\nState of all pins, bit n - 1 holds the state of pin n" }, //
+		{ "set_states", set_states, METH_VARARGS, "set_states(mask, states)\n\nSet state of all output pins selected by mask at once" }, //
+		{ NULL } };
+
+static struct PyModuleDef module = { //
+		PyModuleDef_HEAD_INIT, //
+		.m_name = "mica_gpio", //
+		.m_doc = "Native IO Device Implementation for MICA", //
+		.m_size = -1, //
+		.m_methods = methods };
+
+PyMODINIT_FUNC PyInit_mica_gpio(void) {
+	if (PyType_Ready(&events_type) < 0)
+		return NULL;
+
+	PyObject *m = PyModule_Create(&module);
+	if (m == NULL)
+		return NULL;
+
+	Py_INCREF(&events_type);
+	if (PyModule_AddObject(m, "Events", (PyObject *) &events_type) < 0) {
+		Py_DECREF(&events_type);
+		Py_DECREF(m);
+		return NULL;
+	}
+	PyModule_AddIntConstant(m, "SIZE", MICA_GPIO_SIZE);
+	PyModule_AddIntConstant(m, "INPUT", INPUT);
+	PyModule_AddIntConstant(m, "OUTPUT", OUTPUT);
+	PyModule_AddIntConstant(m, "LOW", LOW);
+	PyModule_AddIntConstant(m, "HIGH", HIGH);
+	PyModule_AddIntConstant(m, "EDGE_NONE", EDGE_NONE);
+	PyModule_AddIntConstant(m, "EDGE_RISING", EDGE_RISING);
+	PyModule_AddIntConstant(m, "EDGE_FALLING", EDGE_FALLING);
+	PyModule_AddIntConstant(m, "EDGE_BOTH", EDGE_BOTH);
+	PyModule_AddIntConstant(m, "DISCONNECTED", MICA_GPIO_DISCONNECTED);
+	PyModule_AddIntConstant(m, "CONNECTED", MICA_GPIO_CONNECTED);
+	PyModule_AddIntConstant(m, "GLITCH", MICA_GPIO_GLITCH);
+	return m;
+}
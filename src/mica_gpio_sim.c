@@ -0,0 +1,347 @@
+/*
+ * mica_gpio_sim.c
+ *
+ * Simulated backend of the MCP 2210 transport, for soak and stress runs without hardware. The MCP 2210 and up to
+ * eight SPI switches are emulated in process, inputs toggle on their own. Faults are injected at random, each with a
+ * probability in per mille of reports, set by environment variables:
+ *
+ *   MICA_GPIO_SIM_SWITCHES   number of switches on chip selects GP1-GP8 [1-8], default 1
+ *   MICA_GPIO_SIM_TOGGLE     mean time between input changes (ms), default 50, 0 for constant inputs
+ *   MICA_GPIO_SIM_DROP       responses dropped
+ *   MICA_GPIO_SIM_BUSY       commands rejected as busy (0xf7 or 0xf8)
+ *   MICA_GPIO_SIM_SPIKE      responses delayed by MICA_GPIO_SIM_LATENCY (ms), default 20
+ *   MICA_GPIO_SIM_DISCONNECT reports failing with the device detached for MICA_GPIO_SIM_DOWN (ms), default 200
+ *   MICA_GPIO_SIM_SEED       seed of the fault sequence, default 1
+ *   MICA_GPIO_SIM_ABSENT     time the device is attached after loading (ms), default 0
+ */
+
+#define _GNU_SOURCE
+
+#include "mica_gpio_transport.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define REPORT_SIZE 64
+#define QUEUE_SIZE  (4 * IN_FLIGHT) // responses not read yet
+#define SWITCHES    8
+
+/** Emulated SPI switch */
+struct device {
+	/** Control registers, diagnosis current enable at 4 and 5 */
+	unsigned char registers[8];
+	/** Answer to the last frame, sent with the next one */
+	unsigned char answer;
+	/** Stand-by */
+	int standby;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static struct device devices[SWITCHES];
+static int switches = 1;
+
+/** Volatile and power-up transfer settings, and power-up chip settings */
+static unsigned char transfer[REPORT_SIZE - 4], nvram_transfer[REPORT_SIZE - 4], nvram_chip[REPORT_SIZE - 4];
+/** Received byte of a started SPI transfer, -1 if none */
+static int pending = -1;
+static unsigned int interrupts = 0;
+
+static unsigned char queue[QUEUE_SIZE][REPORT_SIZE];
+static int queue_head = 0, queue_count = 0;
+
+/** Fault probabilities (per mille) and durations (ms) */
+static int toggle = 50, drop = 0, busy = 0, spike = 0, latency = 20, disconnect = 0, down = 200;
+static unsigned int seed = 1;
+
+static int opened = 0;
+static struct timespec detached_until;
+static struct timespec changed;
+static unsigned long long inputs = 0;
+
+static int _mica_gpio_sim_env(const char *name, int value) {
+	const char *env = getenv(name);
+	return env != NULL ? atoi(env) : value;
+}
+
+/**
+ * @returns 1 with probability of the given per mille
+ */
+static int _mica_gpio_sim_chance(int per_mille) {
+	return per_mille > 0 && rand_r(&seed) % 1000 < per_mille;
+}
+
+static void _mica_gpio_sim_sleep(int ms) {
+	const struct timespec req = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000L };
+	nanosleep(&req, NULL);
+}
+
+static int _mica_gpio_sim_attached() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > detached_until.tv_sec || (now.tv_sec == detached_until.tv_sec && now.tv_nsec >= detached_until.tv_nsec);
+}
+
+static void _mica_gpio_sim_detach(int ms) {
+	clock_gettime(CLOCK_MONOTONIC, &detached_until);
+	detached_until.tv_sec += ms / 1000;
+	detached_until.tv_nsec += ms % 1000 * 1000000L;
+	if (detached_until.tv_nsec >= 1000000000) {
+		detached_until.tv_nsec -= 1000000000;
+		detached_until.tv_sec++;
+	}
+	opened = 0;
+	pthread_cond_broadcast(&cond);
+}
+
+/**
+ * Toggles a random input after a random time, counting falling edges on the interrupt pin
+ */
+static void _mica_gpio_sim_toggle() {
+	if (toggle <= 0)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long elapsed = (now.tv_sec - changed.tv_sec) * 1000LL + (now.tv_nsec - changed.tv_nsec) / 1000000;
+	if (elapsed < rand_r(&seed) % (2 * toggle + 1))
+		return;
+	changed = now;
+	unsigned long long bit = 1ULL << (rand_r(&seed) % (switches * 8));
+	if (inputs & bit)
+		interrupts++;
+	inputs ^= bit;
+}
+
+/**
+ * @returns index of the switch selected by the active chip select value, -1 if none
+ */
+static int _mica_gpio_sim_selected() {
+	int chip_select = transfer[6] | transfer[7] << 8;
+	for (int i = 0; i < switches; i++)
+		if (chip_select == (0x1ff & ~(2 << i)))
+			return i;
+	return -1;
+}
+
+/**
+ * Exchanges a frame with the selected switch
+ * @returns answer to the previous frame
+ */
+static unsigned char _mica_gpio_sim_frame(unsigned char in) {
+	int index = _mica_gpio_sim_selected();
+	if (index < 0)
+		return 0xff;
+	struct device *device = &devices[index];
+	unsigned char out = device->answer, next = 0;
+	if ((in & 0xe0) == 0xe0) {
+		// command
+		if (in & 0x4)
+			device->standby = 1;
+		if (in & 0x8)
+			device->standby = 0;
+	} else if (in & 0x80)
+		device->registers[(in >> 4) & 7] = in & 0xf;
+	else if (in & 1) {
+		// diagnosis register of two pins, open load reported at bits 1 and 3
+		int levels = (inputs >> (index * 8 + ((in >> 4) & 3) * 2)) & 3;
+		next = (levels & 1 ? 2 : 0) | (levels & 2 ? 8 : 0);
+	} else
+		next = device->registers[(in >> 4) & 7];
+	device->answer = next;
+	return out;
+}
+
+/**
+ * Executes command of a report and queues its response, unless dropped
+ */
+static void _mica_gpio_sim_execute(const unsigned char *command) {
+	unsigned char response[REPORT_SIZE] = { command[0] };
+	if (_mica_gpio_sim_chance(busy)) {
+		response[1] = rand_r(&seed) & 1 ? 0xf7 : 0xf8;
+	} else {
+		switch (command[0]) {
+		case 0x12:
+			response[4] = interrupts & 0xff;
+			response[5] = interrupts >> 8;
+			if (command[1] == 0)
+				interrupts = 0;
+			break;
+		case 0x21:
+			break;
+		case 0x40:
+			memcpy(transfer, &command[4], sizeof(transfer));
+			break;
+		case 0x41:
+			response[2] = 17;
+			memcpy(&response[4], transfer, sizeof(transfer));
+			break;
+		case 0x42:
+			if (command[1] > 0) {
+				if (pending >= 0) {
+					response[1] = 0xf8;
+					break;
+				}
+				pending = _mica_gpio_sim_frame(command[4]);
+				response[3] = 0x20;
+			} else if (pending < 0)
+				response[3] = 0x10;
+			else {
+				response[2] = 1;
+				response[3] = 0x10;
+				response[4] = pending;
+				pending = -1;
+			}
+			break;
+		case 0x60:
+			memcpy(command[1] == 0x20 ? nvram_chip : nvram_transfer, &command[4], sizeof(transfer));
+			response[2] = command[1];
+			break;
+		case 0x61:
+			response[2] = command[1];
+			memcpy(&response[4], command[1] == 0x20 ? nvram_chip : nvram_transfer, sizeof(transfer));
+			break;
+		default:
+			response[1] = 0xf9;
+			break;
+		}
+	}
+	if (_mica_gpio_sim_chance(drop) || queue_count == QUEUE_SIZE)
+		return;
+	memcpy(queue[(queue_head + queue_count++) % QUEUE_SIZE], response, REPORT_SIZE);
+	pthread_cond_broadcast(&cond);
+}
+
+/**
+ * Reads the settings from the environment on first use, lock must be held
+ */
+static void _mica_gpio_sim_init() {
+	static int initialized = 0;
+	if (!initialized) {
+		initialized = 1;
+		switches = _mica_gpio_sim_env("MICA_GPIO_SIM_SWITCHES", switches);
+		if (switches < 1 || switches > SWITCHES)
+			switches = 1;
+		toggle = _mica_gpio_sim_env("MICA_GPIO_SIM_TOGGLE", toggle);
+		drop = _mica_gpio_sim_env("MICA_GPIO_SIM_DROP", drop);
+		busy = _mica_gpio_sim_env("MICA_GPIO_SIM_BUSY", busy);
+		spike = _mica_gpio_sim_env("MICA_GPIO_SIM_SPIKE", spike);
+		latency = _mica_gpio_sim_env("MICA_GPIO_SIM_LATENCY", latency);
+		disconnect = _mica_gpio_sim_env("MICA_GPIO_SIM_DISCONNECT", disconnect);
+		down = _mica_gpio_sim_env("MICA_GPIO_SIM_DOWN", down);
+		seed = _mica_gpio_sim_env("MICA_GPIO_SIM_SEED", seed);
+		clock_gettime(CLOCK_MONOTONIC, &changed);
+		printf("INFO: Simulated device with %d switches (drop %d, busy %d, spike %d, disconnect %d per mille)\n", switches, drop, busy, spike,
+				disconnect);
+		int absent = _mica_gpio_sim_env("MICA_GPIO_SIM_ABSENT", 0);
+		if (absent > 0)
+			_mica_gpio_sim_detach(absent);
+	}
+}
+
+int _mica_gpio_transport_open(unsigned short vendor_id, unsigned short product_id) {
+	pthread_mutex_lock(&lock);
+	_mica_gpio_sim_init();
+	if (!_mica_gpio_sim_attached()) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	// a reset device forgets its volatile state
+	queue_head = queue_count = 0;
+	pending = -1;
+	memcpy(transfer, nvram_transfer, sizeof(transfer));
+	opened = 1;
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+void _mica_gpio_transport_close() {
+	pthread_mutex_lock(&lock);
+	opened = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void _mica_gpio_transport_exit() {
+}
+
+int _mica_gpio_transport_wait(unsigned short vendor_id, unsigned short product_id, int timeout) {
+	pthread_mutex_lock(&lock);
+	_mica_gpio_sim_init();
+	int attached = _mica_gpio_sim_attached();
+	pthread_mutex_unlock(&lock);
+	if (!attached)
+		_mica_gpio_sim_sleep(timeout);
+	return attached;
+}
+
+int _mica_gpio_transport_write(const unsigned char *data, size_t length) {
+	pthread_mutex_lock(&lock);
+	if (!opened) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	if (_mica_gpio_sim_chance(disconnect)) {
+		_mica_gpio_sim_detach(down);
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	_mica_gpio_sim_toggle();
+	// skip the report number
+	_mica_gpio_sim_execute(&data[1]);
+	pthread_mutex_unlock(&lock);
+	return length;
+}
+
+int _mica_gpio_transport_read(unsigned char *data, size_t length, int timeout) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += timeout % 1000 * 1000000L;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_nsec -= 1000000000;
+		deadline.tv_sec++;
+	}
+
+	pthread_mutex_lock(&lock);
+	int delayed = _mica_gpio_sim_chance(spike);
+	while (opened && queue_count == 0) {
+		if (timeout < 0)
+			pthread_cond_wait(&cond, &lock);
+		else {
+			// the condition uses the realtime clock, wait in slices against the monotonic deadline
+			struct timespec now, slice;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+				break;
+			clock_gettime(CLOCK_REALTIME, &slice);
+			slice.tv_nsec += 1000000;
+			if (slice.tv_nsec >= 1000000000) {
+				slice.tv_nsec -= 1000000000;
+				slice.tv_sec++;
+			}
+			pthread_cond_timedwait(&cond, &lock, &slice);
+		}
+	}
+	int result = -1;
+	if (opened) {
+		result = 0;
+		if (queue_count > 0) {
+			memcpy(data, queue[queue_head], length < REPORT_SIZE ? length : REPORT_SIZE);
+			queue_head = (queue_head + 1) % QUEUE_SIZE;
+			queue_count--;
+			result = REPORT_SIZE;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	if (result > 0 && delayed)
+		_mica_gpio_sim_sleep(latency);
+	return result;
+}
+
+void _mica_gpio_list() {
+	printf("mica_gpio Device Found\n  type: 2b9d 8001\n  path: simulated\n\n");
+}
@@ -0,0 +1,67 @@
+/*
+ * mica_gpio_transport.h
+ *
+ * USB HID transport of the MCP 2210, implemented by one of the backends
+ * mica_gpio_hidapi.c (synchronous, hidapi) or mica_gpio_libusb.c (asynchronous, libusb)
+ */
+
+#ifndef MICA_GPIO_TRANSPORT_H
+#define MICA_GPIO_TRANSPORT_H
+
+#include <stddef.h>
+
+/** Maximum number of reports queued in the transport */
+#define IN_FLIGHT 8
+
+/**
+ * Open the device using the VID and PID
+ * @returns
+ *     0 Device opened
+ *    -1 Device not found or not accessible
+ */
+int _mica_gpio_transport_open(unsigned short vendor_id, unsigned short product_id);
+
+/**
+ * Close the device
+ */
+void _mica_gpio_transport_close(void);
+
+/**
+ * Free all transport resources, after the device has been closed
+ */
+void _mica_gpio_transport_exit(void);
+
+/**
+ * Wait for the device to be attached
+ * @param timeout milliseconds to wait
+ * @returns
+ *     1 Device is attached
+ *     0 Device not attached within timeout
+ */
+int _mica_gpio_transport_wait(unsigned short vendor_id, unsigned short product_id, int timeout);
+
+/**
+ * Write report to the device. The first byte is the report number, followed by the 64 byte report.
+ * The report may still be in flight on return, but reports are always sent in order.
+ * @returns
+ *     number of bytes written
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_transport_write(const unsigned char *data, size_t length);
+
+/**
+ * Read next report from the device
+ * @param timeout milliseconds to wait, -1 for blocking wait
+ * @returns
+ *     number of bytes read
+ *     0 No report received within timeout
+ *    -1 Communication error occurs
+ */
+int _mica_gpio_transport_read(unsigned char *data, size_t length, int timeout);
+
+/**
+ * Write all attached USB HID devices to stdout
+ */
+void _mica_gpio_list(void);
+
+#endif /* MICA_GPIO_TRANSPORT_H */